@@ -0,0 +1,175 @@
+#include <rnn-descent/AsyncSearcher.h>
+#include <rnn-descent/IndexRNNDescent.h>
+
+#include <argparse/argparse.hpp>
+#include <benches/datasets/DataLoader.hpp>
+#include <benches/utils/Timer.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <thread>
+
+using Clock = std::chrono::steady_clock;
+
+/* Open-loop load: the queries are sent at the times of a Poisson process of
+   rate qps, whatever the latency of the previous ones. The latencies are
+   measured from these times, so that a late send counts as waiting. */
+nlohmann::json run_load(rnndescent::AsyncSearcher& searcher, double qps,
+                        size_t n_requests, size_t nq, const float* xq,
+                        size_t d, const faiss::idx_t* gt, size_t k_gt) {
+    std::vector<double> latencies(n_requests);
+    std::vector<faiss::idx_t> labels(n_requests);
+    std::atomic<size_t> n_done{0};
+    std::vector<Clock::time_point> send_times(n_requests);
+
+    std::mt19937 rng(123);
+    std::exponential_distribution<double> gap(qps);
+    auto start = Clock::now();
+    double t = 0;
+    for (size_t i = 0; i < n_requests; i++) {
+        t += gap(rng);
+        send_times[i] = start + std::chrono::duration_cast<Clock::duration>(
+                                    std::chrono::duration<double>(t));
+        std::this_thread::sleep_until(send_times[i]);
+        searcher.search(xq + (i % nq) * d, 1,
+                        [&, i](rnndescent::AsyncSearchResult&& result) {
+                            latencies[i] =
+                                std::chrono::duration<double, std::micro>(
+                                    Clock::now() - send_times[i])
+                                    .count();
+                            labels[i] = result.labels[0];
+                            n_done++;
+                        });
+    }
+    while (n_done.load() < n_requests) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+
+    size_t n_correct = 0;
+    for (size_t i = 0; i < n_requests; i++) {
+        n_correct += labels[i] == gt[(i % nq) * k_gt];
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    nlohmann::json result;
+    result["offered_qps"] = qps;
+    result["throughput"] = n_requests / elapsed;
+    result["p50_us"] = latencies[n_requests / 2];
+    result["p99_us"] = latencies[n_requests * 99 / 100];
+    result["r@1"] = (double)n_correct / n_requests;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("bench_async_rnndescent");
+    program.add_argument("--S").default_value(20).scan<'i', int>();
+    program.add_argument("--R").default_value(96).scan<'i', int>();
+    program.add_argument("--T1").default_value(4).scan<'i', int>();
+    program.add_argument("--T2").default_value(15).scan<'i', int>();
+    program.add_argument("--search_L").default_value(32).scan<'i', int>();
+    program.add_argument("--n_workers").default_value(4).scan<'i', int>();
+    program.add_argument("--max_batch_size")
+        .default_value(16)
+        .scan<'i', int>();
+    program.add_argument("--n_requests")
+        .default_value(20000)
+        .scan<'i', int>();
+    program.add_argument("--shared_batch_search")
+        .default_value(false)
+        .implicit_value(true)
+        .help("search the batches with RNNDescent::search_batch");
+    program.add_argument("--dataset").required();
+    program.add_argument("--fn_result").required();
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
+
+    std::string dataset_name = program.get<std::string>("--dataset");
+    DataLoader data_loader(dataset_name);
+    size_t d = data_loader.dim();
+
+    nlohmann::json parameters;
+    parameters["S"] = program.get<int>("--S");
+    parameters["R"] = program.get<int>("--R");
+    parameters["T1"] = program.get<int>("--T1");
+    parameters["T2"] = program.get<int>("--T2");
+    parameters["search_L"] = program.get<int>("--search_L");
+    parameters["n_workers"] = program.get<int>("--n_workers");
+    parameters["max_batch_size"] = program.get<int>("--max_batch_size");
+    parameters["shared_batch_search"] =
+        program.get<bool>("--shared_batch_search");
+
+    rnndescent::IndexRNNDescent index(d);
+    index.rnndescent.S = parameters["S"];
+    index.rnndescent.R = parameters["R"];
+    index.rnndescent.T1 = parameters["T1"];
+    index.rnndescent.T2 = parameters["T2"];
+    index.verbose = true;
+    {
+        auto [nb, xb] = data_loader.load_base();
+        Timer timer;
+        index.add(nb, xb.get());
+        std::cout << "Time = " << timer.elapsed_ms() * 1e-3 << " [s]"
+                  << std::endl;
+    }
+    index.rnndescent.search_L = parameters["search_L"];
+
+    auto [nq, xq] = data_loader.load_query();
+    auto [k_gt, gt] = data_loader.load_gt();
+
+    // the offered loads are fractions of the capacity of the workers,
+    // estimated from the single-thread search
+    double capacity;
+    {
+        rnndescent::RNNDescentSearchContext context(index);
+        faiss::idx_t I;
+        float D;
+        Timer timer;
+        for (size_t i = 0; i < nq; i++) {
+            index.search_one(xq.get() + i * d, 1, &D, &I, context);
+        }
+        capacity = nq / (timer.elapsed_ns() * 1e-9) *
+                   program.get<int>("--n_workers");
+    }
+
+    nlohmann::json results;
+    for (int max_wait_us : {0, 50, 200, 1000}) {
+        for (double load : {0.25, 0.5, 0.75, 0.9}) {
+            rnndescent::AsyncSearcher searcher(
+                index, program.get<int>("--n_workers"),
+                program.get<int>("--max_batch_size"), max_wait_us,
+                program.get<bool>("--shared_batch_search"));
+            auto result =
+                run_load(searcher, load * capacity,
+                         program.get<int>("--n_requests"), nq, xq.get(), d,
+                         gt.get(), k_gt);
+            result["max_wait_us"] = max_wait_us;
+            result["load"] = load;
+            result["mean_batch_size"] = searcher.mean_batch_size();
+            std::cout << result.dump() << std::endl;
+            results.push_back(result);
+        }
+    }
+
+    nlohmann::json output;
+    output["dataset"] = dataset_name;
+    output["method"] = "RNN-Descent (async)";
+    output["parameters"] = parameters;
+    output["estimated_capacity_qps"] = capacity;
+    output["load_performances"] = results;
+
+    std::string fn_result = program.get<std::string>("--fn_result");
+    std::ofstream ofs(fn_result);
+    ofs << output.dump(4) << std::endl;
+    std::cout << "Saved the result to \"" << fn_result << "\"" << std::endl;
+}
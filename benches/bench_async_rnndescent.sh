@@ -0,0 +1,23 @@
+set -e
+
+DATASET="siftsmall"
+S=20
+R=96
+T1=4
+T2=15
+SEARCH_L=32
+N_WORKERS=4
+MAX_BATCH_SIZE=16
+
+export OMP_NUM_THREADS=16
+FN_RESULT="benches/results/async_rnndescent.json"
+./build/benches/bench_async_rnndescent \
+    --S ${S} \
+    --R ${R} \
+    --T1 ${T1} \
+    --T2 ${T2} \
+    --search_L ${SEARCH_L} \
+    --n_workers ${N_WORKERS} \
+    --max_batch_size ${MAX_BATCH_SIZE} \
+    --dataset ${DATASET} \
+    --fn_result ${FN_RESULT}
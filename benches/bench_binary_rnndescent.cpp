@@ -0,0 +1,162 @@
+#include <faiss/IndexBinaryFlat.h>
+#include <rnn-descent/IndexBinaryRNNDescent.h>
+
+#include <argparse/argparse.hpp>
+#include <benches/datasets/DataLoader.hpp>
+#include <benches/utils/Timer.hpp>
+#include <benches/utils/graph_properties.hpp>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <random>
+
+/* The binary codes are random hyperplane hashes of the float vectors of the
+   dataset: bit b of a code is the sign of its projection on hyperplane b. */
+std::vector<uint8_t> binarize(size_t n, const float* x, size_t d,
+                              const std::vector<float>& planes, int nbits) {
+    std::vector<uint8_t> codes(n * nbits / 8, 0);
+#pragma omp parallel for
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t* code = codes.data() + i * nbits / 8;
+        for (int b = 0; b < nbits; ++b) {
+            float s = 0;
+            for (size_t j = 0; j < d; ++j) {
+                s += x[i * d + j] * planes[b * d + j];
+            }
+            if (s > 0) {
+                code[b / 8] |= 1 << (b % 8);
+            }
+        }
+    }
+    return codes;
+}
+
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("bench_binary_rnndescent");
+    program.add_argument("--nbits").default_value(256).scan<'i', int>();
+    program.add_argument("--S").default_value(20).scan<'i', int>();
+    program.add_argument("--R").default_value(96).scan<'i', int>();
+    program.add_argument("--T1").default_value(4).scan<'i', int>();
+    program.add_argument("--T2").default_value(15).scan<'i', int>();
+    program.add_argument("--dataset").required();
+    program.add_argument("--fn_result").required();
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
+
+    using idx_t = faiss::idx_t;
+
+    std::string dataset_name = program.get<std::string>("--dataset");
+    DataLoader data_loader(dataset_name);
+    size_t d = data_loader.dim();
+
+    int nbits = program.get<int>("--nbits");
+    if (nbits % 8 != 0) {
+        std::cerr << "--nbits must be a multiple of 8" << std::endl;
+        std::exit(1);
+    }
+    std::vector<float> planes(nbits * d);
+    {
+        std::mt19937 rng(1234);
+        std::normal_distribution<float> normal;
+        for (auto& v : planes) {
+            v = normal(rng);
+        }
+    }
+
+    nlohmann::json parameters;
+    parameters["nbits"] = nbits;
+    parameters["S"] = program.get<int>("--S");
+    parameters["R"] = program.get<int>("--R");
+    parameters["T1"] = program.get<int>("--T1");
+    parameters["T2"] = program.get<int>("--T2");
+
+    std::vector<uint8_t> xb;
+    {
+        auto [nb, xb_float] = data_loader.load_base();
+        xb = binarize(nb, xb_float.get(), d, planes, nbits);
+    }
+    size_t nb = xb.size() / (nbits / 8);
+    auto [nq, xq_float] = data_loader.load_query();
+    auto xq = binarize(nq, xq_float.get(), d, planes, nbits);
+
+    // exhaustive Hamming scan, which gives the ground truth
+    faiss::IndexBinaryFlat flat(nbits);
+    flat.add(nb, xb.data());
+    std::vector<idx_t> gt_labels(nq);
+    std::vector<int32_t> gt_distances(nq);
+    double flat_qps;
+    {
+        Timer timer;
+        flat.search(nq, xq.data(), 1, gt_distances.data(), gt_labels.data());
+        flat_qps = nq / (timer.elapsed_ns() * 1e-9);
+    }
+
+    rnndescent::IndexBinaryRNNDescent index(nbits);
+    index.rnndescent.S = parameters["S"];
+    index.rnndescent.R = parameters["R"];
+    index.rnndescent.T1 = parameters["T1"];
+    index.rnndescent.T2 = parameters["T2"];
+    index.verbose = true;
+
+    double construction_time_sec;
+    {
+        Timer timer;
+        index.add(nb, xb.data());
+        construction_time_sec = timer.elapsed_ms() * 1e-3;
+        std::cout << "Time = " << construction_time_sec << " [s]" << std::endl;
+    }
+
+    // a result is correct if it is at the distance of the nearest neighbor,
+    // since the Hamming distances have many ties
+    nlohmann::json results;
+    const int infty = 1000000;
+    for (int search_L : {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024}) {
+        for (int K0 : {32, 48, 64, infty}) {
+            index.rnndescent.search_L = search_L;
+            index.rnndescent.K0 = K0;
+
+            std::vector<idx_t> I(nq);
+            std::vector<int32_t> D(nq);
+            Timer timer;
+            index.search(nq, xq.data(), 1, D.data(), I.data());
+            double qps = nq / (timer.elapsed_ns() * 1e-9);
+
+            size_t n_correct = 0;
+            for (size_t i = 0; i < nq; ++i) {
+                n_correct += D[i] == gt_distances[i];
+            }
+
+            nlohmann::json result;
+            result["search_L"] = search_L;
+            result["K0"] = K0;
+            result["qps"] = qps;
+            result["r@1"] = (double)n_correct / nq;
+            results.push_back(result);
+        }
+    }
+
+    const auto& offsets = index.rnndescent.offsets;
+    const auto get_range = [&](int u) -> std::tuple<int, int> {
+        return {offsets[u], offsets[u + 1]};
+    };
+
+    nlohmann::json output;
+    output["dataset"] = dataset_name;
+    output["method"] = "RNN-Descent (binary)";
+    output["parameters"] = parameters;
+    output["construction_time"] = construction_time_sec;
+    output["exhaustive_qps"] = flat_qps;
+    output["search_performances"] = results;
+    output["properties"] = graph_properties(
+        index.ntotal, index.rnndescent.final_graph, get_range);
+
+    std::string fn_result = program.get<std::string>("--fn_result");
+    std::ofstream ofs(fn_result);
+    ofs << output.dump(4) << std::endl;
+    std::cout << "Saved the result to \"" << fn_result << "\"" << std::endl;
+}
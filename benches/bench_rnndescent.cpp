@@ -1,32 +1,78 @@
 #include <rnn-descent/IndexRNNDescent.h>
+#include <rnn-descent/VersionedIndexRNNDescent.h>
+#include <rnn-descent/build_checkpoint.h>
+#include <rnn-descent/knn_graph_io.h>
+
+#include <faiss/IndexFlat.h>
+#include <faiss/impl/AuxIndexStructures.h>
 
 #include <argparse/argparse.hpp>
 #include <benches/datasets/DataLoader.hpp>
 #include <benches/utils/Timer.hpp>
 #include <benches/utils/metrics.hpp>
 #include <benches/utils/graph_properties.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include <numeric>
+#include <random>
+#include <thread>
 
-std::tuple<std::unique_ptr<rnndescent::IndexRNNDescent>, double>
-construct_rnn_descent(const DataLoader& data_loader,
-                      const nlohmann::json& parameters) {
-    int d = data_loader.dim();
-    auto index = std::make_unique<rnndescent::IndexRNNDescent>(d);
+std::unique_ptr<rnndescent::IndexRNNDescent> new_index(
+    int d, const std::string& storage) {
+    using faiss::ScalarQuantizer;
+    if (storage == "fp32") {
+        return std::make_unique<rnndescent::IndexRNNDescent>(d);
+    } else if (storage == "fp16") {
+        return std::make_unique<rnndescent::IndexRNNDescentSQ>(
+            d, ScalarQuantizer::QT_fp16);
+    } else if (storage == "bf16") {
+        return std::make_unique<rnndescent::IndexRNNDescentBF16>(d);
+    } else if (storage == "sq8") {
+        return std::make_unique<rnndescent::IndexRNNDescentSQ>(
+            d, ScalarQuantizer::QT_8bit);
+    }
+    throw std::runtime_error("unknown storage " + storage);
+}
+
+std::unique_ptr<rnndescent::IndexRNNDescent> configure_rnn_descent(
+    int d, const nlohmann::json& parameters, const std::string& storage) {
+    auto index = new_index(d, storage);
     index->rnndescent.S = parameters["S"];
     index->rnndescent.R = parameters["R"];
     index->rnndescent.T1 = parameters["T1"];
     index->rnndescent.T2 = parameters["T2"];
+    index->rnndescent.dis_cache_size = parameters["dis_cache_size"];
+    index->rnndescent.hierarchy_levels = parameters["hierarchy_levels"];
+    index->rnndescent.alpha = parameters["alpha"];
+    index->rnndescent.init_with_clustering =
+        parameters["init_with_clustering"];
+    index->build_with_sq8_proxy =
+        parameters.value("build_with_sq8_proxy", false);
+    index->rnndescent.checkpoint_fname =
+        parameters["fn_checkpoint"].get<std::string>();
     index->verbose = true;
+    return index;
+}
 
-    // train
+std::tuple<std::unique_ptr<rnndescent::IndexRNNDescent>, double>
+construct_rnn_descent(const DataLoader& data_loader,
+                      const nlohmann::json& parameters,
+                      const std::string& storage) {
+    auto index = configure_rnn_descent(data_loader.dim(), parameters, storage);
 
-    // add
+    // train and add
     double construction_time_sec;
     {
         auto [nb, xb] = data_loader.load_base();
 
         Timer timer;
+        if (!index->is_trained) {
+            index->train(nb, xb.get());
+        }
         index->add(nb, xb.get());
         construction_time_sec = timer.elapsed_ms() * 1e-3;
         std::cout << "Time = " << construction_time_sec << " [s]" << std::endl;
@@ -65,6 +111,490 @@ nlohmann::json measure_search_performance(rnndescent::IndexRNNDescent& index,
     return results;
 }
 
+// the adaptive stopping criteria, at pool sizes large enough for the hard
+// queries
+nlohmann::json measure_early_termination(rnndescent::IndexRNNDescent& index,
+                                         const DataLoader& data_loader) {
+    auto [nq, xq] = data_loader.load_query();
+    auto [k, gt] = data_loader.load_gt();
+
+    // structured bindings cannot be captured before C++20
+    const int n_queries = nq;
+    const int n_gt = k;
+    const auto& queries = xq;
+    const auto& ground_truth = gt;
+
+    nlohmann::json results;
+    auto measure = [&](const rnndescent::SearchParametersRNNDescent& params) {
+        auto [qps, r_at_1] = compute_qps_recall(index, n_queries, queries, n_gt,
+                                                ground_truth, &params);
+
+        nlohmann::json result;
+        result["search_L"] = params.search_L;
+        result["patience"] = params.patience;
+        result["distance_ratio"] = params.distance_ratio;
+        result["qps"] = qps;
+        result["r@1"] = r_at_1;
+        results.push_back(result);
+    };
+
+    for (int search_L : {64, 128, 256, 512}) {
+        for (int patience : {8, 16, 32, 64}) {
+            rnndescent::SearchParametersRNNDescent params;
+            params.search_L = search_L;
+            params.patience = patience;
+            measure(params);
+        }
+        for (float distance_ratio : {1.1f, 1.2f, 1.5f, 2.0f}) {
+            rnndescent::SearchParametersRNNDescent params;
+            params.search_L = search_L;
+            params.distance_ratio = distance_ratio;
+            measure(params);
+        }
+    }
+
+    return results;
+}
+
+// search_with_batches compared to search, at the same pool sizes. Empty if
+// the index cannot search by batches.
+nlohmann::json measure_batch_search(rnndescent::IndexRNNDescent& index,
+                                    const DataLoader& data_loader) {
+    auto [nq, xq] = data_loader.load_query();
+    auto [k, gt] = data_loader.load_gt();
+
+    nlohmann::json results;
+    std::unique_ptr<faiss::idx_t[]> I(new faiss::idx_t[nq]);
+    std::unique_ptr<float[]> D(new float[nq]);
+    for (int search_L : {8, 16, 32, 64}) {
+        rnndescent::SearchParametersRNNDescent params;
+        params.search_L = search_L;
+        Timer timer;
+        if (!index.search_with_batches(nq, xq.get(), 1, D.get(), I.get(),
+                                       &params)) {
+            return results;
+        }
+        double batch_qps = nq / (timer.elapsed_ns() * 1e-9);
+
+        auto [qps, r_at_1] = compute_qps_recall(index, nq, xq, k, gt, &params);
+        nlohmann::json result;
+        result["search_L"] = search_L;
+        result["qps"] = qps;
+        result["r@1"] = r_at_1;
+        result["batch_qps"] = batch_qps;
+        result["batch_r@1"] = recall_at_k(nq, 1, 1, I, k, gt);
+        results.push_back(result);
+    }
+    return results;
+}
+
+// KNN graph of the whole base computed from the index, its recall is
+// measured on a sample of the vectors against IndexFlat
+nlohmann::json measure_knn_graph(rnndescent::IndexRNNDescent& index,
+                                 const DataLoader& data_loader, int k,
+                                 const std::string& fn_knn_graph) {
+    size_t d = data_loader.dim();
+    const size_t n = index.ntotal;
+    nlohmann::json results;
+    results["k"] = k;
+
+    std::vector<faiss::idx_t> labels(n * k);
+    std::vector<float> distances(n * k);
+    for (int search_L : {32, 64}) {
+        rnndescent::SearchParametersRNNDescent params;
+        params.search_L = search_L;
+        Timer timer;
+        index.compute_knn_graph(k, labels.data(), distances.data(), &params);
+        nlohmann::json result;
+        result["search_L"] = search_L;
+        result["time_s"] = timer.elapsed_ns() * 1e-9;
+        results["graph"].push_back(result);
+    }
+
+    const size_t n_sample = std::min<size_t>(1000, n);
+    auto [nb, xb] = data_loader.load_base();
+    faiss::IndexFlat flat(d, index.metric_type);
+    flat.add(nb, xb.get());
+    std::vector<float> sample(n_sample * d);
+    for (size_t i = 0; i < n_sample; i++) {
+        memcpy(sample.data() + i * d, xb.get() + i * (n / n_sample) * d,
+               sizeof(float) * d);
+    }
+    std::vector<faiss::idx_t> exact(n_sample * (k + 1));
+    std::vector<float> exact_dis(n_sample * (k + 1));
+    Timer timer;
+    flat.search(n_sample, sample.data(), k + 1, exact_dis.data(),
+                exact.data());
+    results["flat_time_s_estimate"] =
+        timer.elapsed_ns() * 1e-9 * n / n_sample;
+
+    // the recall of the last graph, the vector itself is not a neighbor
+    size_t n_found = 0, n_exact = 0;
+    for (size_t i = 0; i < n_sample; i++) {
+        size_t u = i * (n / n_sample);
+        const faiss::idx_t* found = labels.data() + u * k;
+        for (int j = 0; j < k + 1 && n_exact < (i + 1) * k; j++) {
+            faiss::idx_t v = exact[i * (k + 1) + j];
+            if (v == (faiss::idx_t)u) continue;
+            n_exact++;
+            n_found += std::find(found, found + k, v) != found + k;
+        }
+    }
+    results["recall"] = (double)n_found / n_exact;
+
+    if (!fn_knn_graph.empty()) {
+        rnndescent::write_knn_graph(fn_knn_graph.c_str(), n, k,
+                                    labels.data(), distances.data());
+        std::cout << "Saved the KNN graph to \"" << fn_knn_graph << "\""
+                  << std::endl;
+    }
+    return results;
+}
+
+// graph-based range search compared to the exhaustive one of IndexFlat, for
+// several pool sizes
+nlohmann::json measure_range_search(rnndescent::IndexRNNDescent& index,
+                                    const DataLoader& data_loader,
+                                    float radius) {
+    size_t d = data_loader.dim();
+    auto [nq, xq] = data_loader.load_query();
+
+    nlohmann::json results;
+    results["radius"] = radius;
+
+    faiss::RangeSearchResult exact(nq);
+    {
+        auto [nb, xb] = data_loader.load_base();
+        faiss::IndexFlat flat(d, index.metric_type);
+        flat.add(nb, xb.get());
+        Timer timer;
+        flat.range_search(nq, xq.get(), radius, &exact);
+        results["flat_qps"] = nq / (timer.elapsed_ns() * 1e-9);
+    }
+    results["mean_results"] = (double)exact.lims[nq] / nq;
+
+    for (int search_L : {16, 32, 64, 128}) {
+        rnndescent::SearchParametersRNNDescent params;
+        params.search_L = search_L;
+        faiss::RangeSearchResult result(nq);
+        Timer timer;
+        index.range_search(nq, xq.get(), radius, &result, &params);
+        double qps = nq / (timer.elapsed_ns() * 1e-9);
+
+        size_t n_found = 0, n_duplicates = 0;
+        for (size_t q = 0; q < nq; q++) {
+            std::vector<faiss::idx_t> found(result.labels + result.lims[q],
+                                            result.labels + result.lims[q + 1]);
+            std::sort(found.begin(), found.end());
+            auto last = std::unique(found.begin(), found.end());
+            n_duplicates += found.end() - last;
+            found.erase(last, found.end());
+            for (size_t j = exact.lims[q]; j < exact.lims[q + 1]; j++) {
+                n_found += std::binary_search(found.begin(), found.end(),
+                                              exact.labels[j]);
+            }
+        }
+
+        nlohmann::json result_L;
+        result_L["search_L"] = search_L;
+        result_L["qps"] = qps;
+        result_L["recall"] =
+            exact.lims[nq] == 0 ? 1.0 : (double)n_found / exact.lims[nq];
+        // a label is returned once per query
+        result_L["n_duplicates"] = n_duplicates;
+        results["graph"].push_back(result_L);
+    }
+    return results;
+}
+
+// latencies of single queries sent by n_threads threads at the same time,
+// through search_one and through the OpenMP path that search took for them
+// before search_one: a parallel region where every thread sets up its
+// visited table and distance computer, and one of them searches
+nlohmann::json measure_latency(rnndescent::IndexRNNDescent& index,
+                               const DataLoader& data_loader, int n_threads) {
+    size_t d = data_loader.dim();
+    auto [nq, xq] = data_loader.load_query();
+    const int n_queries = nq;
+    const float* queries = xq.get();
+    const int search_L = index.rnndescent.search_L;
+    index.rnndescent.search_L = 32;
+
+    auto percentiles = [&](bool use_search_one) {
+        std::vector<std::vector<double>> latencies(n_threads);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < n_threads; t++) {
+            threads.emplace_back([&, t]() {
+                rnndescent::RNNDescentSearchContext context(index);
+                faiss::idx_t I;
+                float D;
+                for (int i = t; i < n_queries; i += n_threads) {
+                    auto start = std::chrono::steady_clock::now();
+                    if (use_search_one) {
+                        index.search_one(queries + i * d, 1, &D, &I, context);
+                    } else {
+#pragma omp parallel
+                        {
+                            rnndescent::RNNDescentSearchContext omp_context(
+                                index);
+#pragma omp for
+                            for (int j = i; j < i + 1; j++) {
+                                index.search_one(queries + j * d, 1, &D, &I,
+                                                 omp_context);
+                            }
+                        }
+                    }
+                    latencies[t].push_back(
+                        std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        std::vector<double> all;
+        for (auto& l : latencies) {
+            all.insert(all.end(), l.begin(), l.end());
+        }
+        std::sort(all.begin(), all.end());
+        nlohmann::json result;
+        result["p50_us"] = all[all.size() / 2];
+        result["p99_us"] = all[all.size() * 99 / 100];
+        return result;
+    };
+
+    nlohmann::json results;
+    results["n_threads"] = n_threads;
+    results["search_L"] = 32;
+    results["openmp"] = percentiles(false);
+    results["search_one"] = percentiles(true);
+    index.rnndescent.search_L = search_L;
+    return results;
+}
+
+// single queries replayed from a trace where query i is drawn with a
+// probability proportional to 1 / (i + 1)^zipf_s, without and with the
+// query cache
+nlohmann::json measure_query_cache(rnndescent::IndexRNNDescent& index,
+                                   const DataLoader& data_loader,
+                                   size_t trace_length, size_t cache_size,
+                                   double zipf_s) {
+    size_t d = data_loader.dim();
+    auto [nq, xq] = data_loader.load_query();
+    auto [k, gt] = data_loader.load_gt();
+    index.rnndescent.search_L = 32;
+
+    std::vector<double> cdf(nq);
+    double sum = 0;
+    for (size_t i = 0; i < nq; i++) {
+        sum += 1.0 / std::pow(i + 1, zipf_s);
+        cdf[i] = sum;
+    }
+    std::mt19937 rng(123);
+    std::uniform_real_distribution<double> uniform(0, sum);
+    std::vector<size_t> trace(trace_length);
+    for (auto& q : trace) {
+        q = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) -
+            cdf.begin();
+        q = std::min(q, nq - 1);
+    }
+
+    // the results of the trace are kept to compare the cached ones to them
+    auto replay = [&](std::vector<faiss::idx_t>& I, std::vector<float>& D) {
+        I.resize(trace_length);
+        D.resize(trace_length);
+        size_t n_ok = 0;
+        Timer timer;
+        for (size_t i = 0; i < trace_length; i++) {
+            size_t q = trace[i];
+            index.search(1, xq.get() + q * d, 1, &D[i], &I[i]);
+            n_ok += I[i] == gt[q * k];
+        }
+        double elapsed_sec = timer.elapsed_ms() * 1e-3;
+        nlohmann::json result;
+        result["qps"] = trace_length / elapsed_sec;
+        result["r@1"] = (double)n_ok / trace_length;
+        return result;
+    };
+
+    nlohmann::json results;
+    results["trace_length"] = trace_length;
+    results["zipf_s"] = zipf_s;
+    results["cache_size"] = cache_size;
+    results["search_L"] = 32;
+    std::vector<faiss::idx_t> I_uncached, I_cached;
+    std::vector<float> D_uncached, D_cached;
+    results["uncached"] = replay(I_uncached, D_uncached);
+    index.enable_query_cache(cache_size);
+    results["cached"] = replay(I_cached, D_cached);
+    results["cached"]["hit_rate"] = index.query_cache->hit_rate();
+    results["cached"]["same_results"] =
+        I_cached == I_uncached && D_cached == D_uncached;
+    index.query_cache.reset();
+    return results;
+}
+
+// a build interrupted after its first outer iteration, then resumed from
+// its checkpoint, compared to the uninterrupted build index. The
+// interruption is simulated by writing the checkpoint of the state of the
+// build after one iteration, reached with the distances of the build.
+nlohmann::json measure_checkpoint_resume(rnndescent::IndexRNNDescent& index,
+                                         const DataLoader& data_loader,
+                                         const nlohmann::json& parameters,
+                                         const std::string& storage,
+                                         const std::string& fn_checkpoint) {
+    int d = data_loader.dim();
+    auto [nb, xb] = data_loader.load_base();
+    auto [nq, xq] = data_loader.load_query();
+    auto [k, gt] = data_loader.load_gt();
+    nlohmann::json resume_parameters = parameters;
+    resume_parameters["fn_checkpoint"] = fn_checkpoint;
+
+    nlohmann::json results;
+    {
+        auto interrupted = configure_rnn_descent(d, parameters, storage);
+        if (!interrupted->is_trained) {
+            interrupted->train(nb, xb.get());
+        }
+        interrupted->storage->add(nb, xb.get());
+        auto& rnnd = interrupted->rnndescent;
+        std::unique_ptr<faiss::DistanceComputer> dis(
+            rnndescent::storage_distance_computer(interrupted->storage));
+        rnnd.ntotal = nb;
+        if (rnnd.init_with_clustering) {
+            rnnd.init_graph_clustering(*dis, xb.get(), false);
+        } else {
+            rnnd.init_graph(*dis);
+        }
+        rnnd.refine_graph(*dis, 1, false, false);
+        rnnd.add_reverse_edges();
+        rnndescent::write_build_checkpoint(fn_checkpoint.c_str(), rnnd,
+                                           rnnd.T1, 1);
+    }
+
+    auto resumed = configure_rnn_descent(d, resume_parameters, storage);
+    Timer timer;
+    if (!resumed->is_trained) {
+        resumed->train(nb, xb.get());
+    }
+    resumed->add(nb, xb.get());
+    results["resume_time_s"] = timer.elapsed_ms() * 1e-3;
+
+    for (int search_L : {16, 32, 64}) {
+        rnndescent::SearchParametersRNNDescent params;
+        params.search_L = search_L;
+        nlohmann::json result;
+        result["search_L"] = search_L;
+        result["r@1_uninterrupted"] =
+            compute_qps_recall(index, nq, xq, k, gt, &params).second;
+        result["r@1_resumed"] =
+            compute_qps_recall(*resumed, nq, xq, k, gt, &params).second;
+        results["search"].push_back(result);
+    }
+    return results;
+}
+
+// latencies of the queries searched from one thread while another one
+// replaces batches of batch_size vectors of the index (removes them and adds
+// them again), compared to the latencies without updates, then the recall
+// of the updated index compared to the built one
+nlohmann::json measure_concurrent_updates(
+    std::unique_ptr<rnndescent::IndexRNNDescent> index,
+    const DataLoader& data_loader, int batch_size) {
+    size_t d = data_loader.dim();
+    auto [nb, xb] = data_loader.load_base();
+    auto [nq, xq] = data_loader.load_query();
+    auto [k_gt, gt] = data_loader.load_gt();
+    const size_t n_base = nb;
+    const int n_queries = nq;
+    const float* base = xb.get();
+    const float* queries = xq.get();
+    const faiss::idx_t* gt_ids = gt.get();
+    const size_t gt_k = k_gt;
+    batch_size = std::min<size_t>(batch_size, n_base);
+
+    const std::vector<int> search_Ls = {16, 32, 64};
+    nlohmann::json recalls;
+    for (int search_L : search_Ls) {
+        rnndescent::SearchParametersRNNDescent params;
+        params.search_L = search_L;
+        nlohmann::json result;
+        result["search_L"] = search_L;
+        result["r@1_built"] =
+            compute_qps_recall(*index, nq, xq, k_gt, gt, &params).second;
+        recalls.push_back(result);
+    }
+
+    index->rnndescent.search_L = 32;
+    rnndescent::VersionedIndexRNNDescent versioned(index.release());
+
+    // searches all the queries at least once, until stop is set
+    auto search_until = [&](const std::atomic<bool>& stop) {
+        std::vector<double> latencies;
+        size_t n_correct = 0;
+        faiss::idx_t I;
+        float D;
+        do {
+            for (int i = 0; i < n_queries; i++) {
+                auto start = std::chrono::steady_clock::now();
+                versioned.search(1, queries + i * d, 1, &D, &I);
+                latencies.push_back(std::chrono::duration<double, std::micro>(
+                                        std::chrono::steady_clock::now() -
+                                        start)
+                                        .count());
+                n_correct += I == gt_ids[i * gt_k];
+            }
+        } while (!stop);
+
+        nlohmann::json result;
+        result["r@1"] = (double)n_correct / latencies.size();
+        std::sort(latencies.begin(), latencies.end());
+        result["p50_us"] = latencies[latencies.size() / 2];
+        result["p99_us"] = latencies[latencies.size() * 99 / 100];
+        return result;
+    };
+
+    nlohmann::json results;
+    results["batch_size"] = batch_size;
+    std::atomic<bool> stop{true};
+    results["without_updates"] = search_until(stop);
+
+    const int n_updates = 10;
+    std::vector<double> update_ms;
+    stop = false;
+    std::thread writer([&]() {
+        std::vector<faiss::idx_t> ids(batch_size);
+        for (int u = 0; u < n_updates; u++) {
+            size_t i0 = (size_t)u * batch_size % (n_base - batch_size + 1);
+            std::iota(ids.begin(), ids.end(), i0);
+            Timer timer;
+            versioned.update(batch_size, base + i0 * d, ids.data(),
+                             batch_size, ids.data());
+            update_ms.push_back(timer.elapsed_ms());
+        }
+        stop = true;
+    });
+    results["during_updates"] = search_until(stop);
+    writer.join();
+    results["update_ms"] = update_ms;
+
+    // the updates keep the ids, so that the ground truth still applies
+    std::unique_ptr<faiss::idx_t[]> I(new faiss::idx_t[n_queries]);
+    std::unique_ptr<float[]> D(new float[n_queries]);
+    for (size_t i = 0; i < search_Ls.size(); i++) {
+        rnndescent::SearchParametersRNNDescent params;
+        params.search_L = search_Ls[i];
+        versioned.search(n_queries, queries, 1, D.get(), I.get(), &params);
+        recalls[i]["r@1_updated"] =
+            recall_at_k(n_queries, 1, 1, I, gt_k, gt);
+    }
+    results["search"] = recalls;
+    return results;
+}
+
 nlohmann::json rnndescent_properties(const rnndescent::IndexRNNDescent& index) {
     const int n = index.ntotal;
     const auto& neighbors = index.rnndescent.final_graph;
@@ -75,12 +605,146 @@ nlohmann::json rnndescent_properties(const rnndescent::IndexRNNDescent& index) {
     return graph_properties(n, neighbors, get_range);
 }
 
+// the base built in two halves that are then merged, compared to the index
+// built on the whole base
+nlohmann::json measure_merge(rnndescent::IndexRNNDescent& index,
+                             const DataLoader& data_loader,
+                             const nlohmann::json& parameters,
+                             const std::string& storage) {
+    int d = data_loader.dim();
+    auto [nb, xb] = data_loader.load_base();
+    auto [nq, xq] = data_loader.load_query();
+    auto [k, gt] = data_loader.load_gt();
+    const size_t n0 = nb / 2;
+
+    nlohmann::json results;
+    auto merged = configure_rnn_descent(d, parameters, storage);
+    auto other = configure_rnn_descent(d, parameters, storage);
+    if (!merged->is_trained) {
+        merged->train(nb, xb.get());
+        other->train(nb, xb.get());
+    }
+    {
+        Timer timer;
+        merged->add(n0, xb.get());
+        other->add(nb - n0, xb.get() + n0 * d);
+        results["shards_time_s"] = timer.elapsed_ms() * 1e-3;
+    }
+    {
+        Timer timer;
+        merged->merge_from(*other);
+        results["merge_time_s"] = timer.elapsed_ms() * 1e-3;
+    }
+
+    for (int search_L : {16, 32, 64}) {
+        rnndescent::SearchParametersRNNDescent params;
+        params.search_L = search_L;
+        nlohmann::json result;
+        result["search_L"] = search_L;
+        result["r@1_built"] =
+            compute_qps_recall(index, nq, xq, k, gt, &params).second;
+        result["r@1_merged"] =
+            compute_qps_recall(*merged, nq, xq, k, gt, &params).second;
+        results["search"].push_back(result);
+    }
+    return results;
+}
+
 int main(int argc, char** argv) {
     argparse::ArgumentParser program("bench_rnndescent");
     program.add_argument("--S").default_value(20).scan<'i', int>();
     program.add_argument("--R").default_value(96).scan<'i', int>();
     program.add_argument("--T1").default_value(4).scan<'i', int>();
     program.add_argument("--T2").default_value(15).scan<'i', int>();
+    program.add_argument("--dis_cache_size").default_value(0).scan<'i', int>();
+    program.add_argument("--alpha")
+        .default_value(1.0f)
+        .scan<'g', float>()
+        .help("relaxation of the pruning in the last iteration");
+    program.add_argument("--init_with_clustering")
+        .default_value(false)
+        .implicit_value(true)
+        .help("initialize the graph from a k-means clustering of the base");
+    program.add_argument("--alpha_sweep")
+        .default_value(false)
+        .implicit_value(true)
+        .help("also build and measure the index for several alphas");
+    program.add_argument("--sq8_proxy")
+        .default_value(false)
+        .implicit_value(true)
+        .help("also build and measure the index with SQ8 proxy distances");
+    program.add_argument("--hierarchy_levels")
+        .default_value(0)
+        .scan<'i', int>()
+        .help("levels of the navigation hierarchy above the graph");
+    program.add_argument("--storage")
+        .default_value(std::string("fp32"))
+        .help("fp32, fp16, bf16 or sq8, the others are compared to fp32");
+    program.add_argument("--huge_pages")
+        .default_value(false)
+        .implicit_value(true)
+        .help("also measure the search with huge pages");
+    program.add_argument("--early_termination")
+        .default_value(false)
+        .implicit_value(true)
+        .help("also measure the search with adaptive stopping criteria");
+    program.add_argument("--search_team_size")
+        .default_value(1)
+        .scan<'i', int>()
+        .help("also measure the search with this many threads per query");
+    program.add_argument("--search_batch_size")
+        .default_value(1)
+        .scan<'i', int>()
+        .help("also measure search_with_batches with batches of this many "
+              "queries (needs --hierarchy_levels)");
+    program.add_argument("--latency_threads")
+        .default_value(0)
+        .scan<'i', int>()
+        .help("also measure the latency of single queries from this many "
+              "threads");
+    program.add_argument("--range_radius")
+        .default_value(0.0f)
+        .scan<'g', float>()
+        .help("also measure the range search with this radius (squared "
+              "for L2)");
+    program.add_argument("--knn_graph_k")
+        .default_value(0)
+        .scan<'i', int>()
+        .help("also compute the KNN graph of the base with this k");
+    program.add_argument("--fn_knn_graph")
+        .default_value(std::string(""))
+        .help("file to write the KNN graph to (see write_knn_graph)");
+    program.add_argument("--update_batch_size")
+        .default_value(0)
+        .scan<'i', int>()
+        .help("also measure the search while batches of this many vectors "
+              "are replaced in a VersionedIndexRNNDescent");
+    program.add_argument("--zipf_trace")
+        .default_value(0)
+        .scan<'i', int>()
+        .help("also replay this many single queries drawn from a Zipf "
+              "distribution, without and with the query cache");
+    program.add_argument("--zipf_s")
+        .default_value(1.0)
+        .scan<'g', double>();
+    program.add_argument("--query_cache_size")
+        .default_value(1000)
+        .scan<'i', int>()
+        .help("number of results kept by the query cache");
+    program.add_argument("--fn_checkpoint")
+        .default_value(std::string(""))
+        .help("file to checkpoint the build to, a build interrupted after "
+              "a checkpoint resumes from it when run again");
+    program.add_argument("--checkpoint_resume")
+        .default_value(false)
+        .implicit_value(true)
+        .help("also resume a build interrupted after one iteration and "
+              "compare it to the uninterrupted one");
+    program.add_argument("--merge")
+        .default_value(false)
+        .implicit_value(true)
+        .help("also build the index in two halves, merge them and compare "
+              "the result to the index built at once");
     program.add_argument("--dataset").required();
     program.add_argument("--fn_result").required();
 
@@ -100,9 +764,24 @@ int main(int argc, char** argv) {
     parameters["R"] = program.get<int>("--R");
     parameters["T1"] = program.get<int>("--T1");
     parameters["T2"] = program.get<int>("--T2");
+    parameters["dis_cache_size"] = program.get<int>("--dis_cache_size");
+    parameters["hierarchy_levels"] = program.get<int>("--hierarchy_levels");
+    parameters["alpha"] = program.get<float>("--alpha");
+    parameters["init_with_clustering"] =
+        program.get<bool>("--init_with_clustering");
+    parameters["fn_checkpoint"] = program.get<std::string>("--fn_checkpoint");
+
+    std::string storage = program.get<std::string>("--storage");
+    parameters["storage"] = storage;
 
     auto [index, construction_time] =
-        construct_rnn_descent(data_loader, parameters);
+        construct_rnn_descent(data_loader, parameters, storage);
+    nlohmann::json build_stats;
+    build_stats["n_dis"] = rnndescent::rnndescent_stats.n_dis.load();
+    build_stats["cache_hit_rate"] =
+        rnndescent::rnndescent_stats.cache_hit_rate();
+    build_stats["simd_level"] = rnndescent::simd_level_name(
+        rnndescent::rnndescent_stats.simd_level.load());
     auto results = measure_search_performance(*index, data_loader);
 
     nlohmann::json output;
@@ -110,8 +789,134 @@ int main(int argc, char** argv) {
     output["method"] = "RNN-Descent";
     output["parameters"] = parameters;
     output["construction_time"] = construction_time;
+    output["build_stats"] = build_stats;
     output["search_performances"] = results;
     output["properties"] = rnndescent_properties(*index);
+    output["storage_bytes"] = index->storage->sa_code_size() * index->ntotal;
+
+    if (program.get<bool>("--huge_pages")) {
+        bool enabled = index->enable_huge_pages();
+        output["huge_pages_enabled"] = enabled;
+        if (enabled) {
+            output["search_performances_huge_pages"] =
+                measure_search_performance(*index, data_loader);
+        }
+    }
+
+    if (program.get<bool>("--early_termination")) {
+        output["search_performances_early_termination"] =
+            measure_early_termination(*index, data_loader);
+    }
+
+    int search_team_size = program.get<int>("--search_team_size");
+    if (search_team_size > 1) {
+        index->rnndescent.search_team_size = search_team_size;
+        output["search_team_size"] = search_team_size;
+        output["search_performances_team"] =
+            measure_search_performance(*index, data_loader);
+        index->rnndescent.search_team_size = 1;
+    }
+
+    int search_batch_size = program.get<int>("--search_batch_size");
+    if (search_batch_size > 1) {
+        index->rnndescent.search_batch_size = search_batch_size;
+        output["search_batch_size"] = search_batch_size;
+        output["search_performances_batch"] =
+            measure_batch_search(*index, data_loader);
+        index->rnndescent.search_batch_size = 1;
+    }
+
+    int knn_graph_k = program.get<int>("--knn_graph_k");
+    if (knn_graph_k > 0) {
+        output["knn_graph"] =
+            measure_knn_graph(*index, data_loader, knn_graph_k,
+                              program.get<std::string>("--fn_knn_graph"));
+    }
+
+    float range_radius = program.get<float>("--range_radius");
+    if (range_radius > 0) {
+        output["range_search"] =
+            measure_range_search(*index, data_loader, range_radius);
+    }
+
+    int latency_threads = program.get<int>("--latency_threads");
+    if (latency_threads > 0) {
+        output["latency"] =
+            measure_latency(*index, data_loader, latency_threads);
+    }
+
+    if (program.get<bool>("--checkpoint_resume")) {
+        std::string fn_checkpoint = program.get<std::string>("--fn_checkpoint");
+        output["checkpoint_resume"] = measure_checkpoint_resume(
+            *index, data_loader, parameters, storage,
+            fn_checkpoint.empty() ? "rnndescent.checkpoint" : fn_checkpoint);
+    }
+
+    if (program.get<bool>("--merge")) {
+        output["merge"] =
+            measure_merge(*index, data_loader, parameters, storage);
+    }
+
+    int zipf_trace = program.get<int>("--zipf_trace");
+    if (zipf_trace > 0) {
+        output["query_cache"] = measure_query_cache(
+            *index, data_loader, zipf_trace,
+            program.get<int>("--query_cache_size"),
+            program.get<double>("--zipf_s"));
+    }
+
+    // the index is moved into the versioned index, it is not used after
+    int update_batch_size = program.get<int>("--update_batch_size");
+    if (update_batch_size > 0) {
+        output["concurrent_updates"] = measure_concurrent_updates(
+            std::move(index), data_loader, update_batch_size);
+    }
+
+    if (program.get<bool>("--sq8_proxy")) {
+        index.reset();
+        nlohmann::json proxy_parameters = parameters;
+        proxy_parameters["build_with_sq8_proxy"] = true;
+        auto [proxy_index, proxy_construction_time] =
+            construct_rnn_descent(data_loader, proxy_parameters, storage);
+        nlohmann::json sq8_proxy;
+        sq8_proxy["construction_time"] = proxy_construction_time;
+        sq8_proxy["search_performances"] =
+            measure_search_performance(*proxy_index, data_loader);
+        sq8_proxy["properties"] = rnndescent_properties(*proxy_index);
+        output["sq8_proxy"] = sq8_proxy;
+    }
+
+    if (program.get<bool>("--alpha_sweep")) {
+        index.reset();
+        nlohmann::json sweep;
+        for (float alpha : {1.0f, 1.1f, 1.2f, 1.3f, 1.5f}) {
+            nlohmann::json alpha_parameters = parameters;
+            alpha_parameters["alpha"] = alpha;
+            auto [alpha_index, alpha_construction_time] =
+                construct_rnn_descent(data_loader, alpha_parameters, storage);
+            nlohmann::json result;
+            result["alpha"] = alpha;
+            result["construction_time"] = alpha_construction_time;
+            result["search_performances"] =
+                measure_search_performance(*alpha_index, data_loader);
+            result["properties"] = rnndescent_properties(*alpha_index);
+            sweep.push_back(result);
+        }
+        output["alpha_sweep"] = sweep;
+    }
+
+    if (storage != "fp32") {
+        index.reset();
+        auto [baseline, baseline_construction_time] =
+            construct_rnn_descent(data_loader, parameters, "fp32");
+        nlohmann::json fp32;
+        fp32["construction_time"] = baseline_construction_time;
+        fp32["search_performances"] =
+            measure_search_performance(*baseline, data_loader);
+        fp32["storage_bytes"] =
+            baseline->storage->sa_code_size() * baseline->ntotal;
+        output["fp32_baseline"] = fp32;
+    }
 
     std::string fn_result = program.get<std::string>("--fn_result");
     std::ofstream ofs(fn_result);
@@ -5,6 +5,9 @@ S=20
 R=96
 T1=4
 T2=15
+STORAGE="fp32"  # fp32, fp16, bf16 or sq8
+HIERARCHY_LEVELS=0
+ALPHA=1.0
 
 export OMP_NUM_THREADS=16
 FN_RESULT="benches/results/rnndescent.json"
@@ -13,5 +16,8 @@ FN_RESULT="benches/results/rnndescent.json"
     --R ${R} \
     --T1 ${T1} \
     --T2 ${T2} \
+    --storage ${STORAGE} \
+    --hierarchy_levels ${HIERARCHY_LEVELS} \
+    --alpha ${ALPHA} \
     --dataset ${DATASET} \
     --fn_result ${FN_RESULT}
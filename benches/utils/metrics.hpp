@@ -29,7 +29,8 @@ template <class T>
 std::pair<double, double> compute_qps_recall(
     const T& index, const int nq,
     const std::unique_ptr<float[]>& xq, const int k,
-    const std::unique_ptr<faiss::idx_t[]>& gt) {
+    const std::unique_ptr<faiss::idx_t[]>& gt,
+    const faiss::SearchParameters* params = nullptr) {
     static_assert(std::is_base_of<faiss::Index, T>::value);
     using idx_t = faiss::idx_t;
 
@@ -37,7 +38,7 @@ std::pair<double, double> compute_qps_recall(
     std::unique_ptr<float[]> D(new float[nq]);
 
     Timer timer;
-    index.search(nq, xq.get(), 1, D.get(), I.get());
+    index.search(nq, xq.get(), 1, D.get(), I.get(), params);
     auto elapsed = timer.elapsed_ns() * 1e-9;
 
     float qps = nq / elapsed;
@@ -0,0 +1,254 @@
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/utils/distances.h>
+#include <rnn-descent/AsyncSearcher.h>
+#include <rnn-descent/DistanceComputer.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+
+namespace rnndescent {
+
+namespace {
+
+bool equal_params(const SearchParametersRNNDescent* a,
+                  const SearchParametersRNNDescent* b) {
+    if (!a || !b) {
+        return a == b;
+    }
+    return a->search_L == b->search_L && a->patience == b->patience &&
+           a->distance_ratio == b->distance_ratio;
+}
+
+}  // namespace
+
+AsyncSearcher::AsyncSearcher(const IndexRNNDescent& index, int n_workers,
+                             int max_batch_size, int max_wait_us,
+                             bool shared_batch_search, size_t queue_size)
+    : index(index),
+      max_batch_size(std::max(max_batch_size, 1)),
+      max_wait(max_wait_us),
+      shared_batch_search(shared_batch_search),
+      queue(queue_size) {
+    FAISS_THROW_IF_NOT(n_workers > 0);
+    FAISS_THROW_IF_NOT_MSG(
+        !index.cosine || index.metric_type == faiss::METRIC_INNER_PRODUCT,
+        "cosine requires METRIC_INNER_PRODUCT");
+    for (int i = 0; i < n_workers; i++) {
+        workers.emplace_back([this]() { worker_loop(); });
+    }
+}
+
+AsyncSearcher::~AsyncSearcher() {
+    shutdown();
+}
+
+void AsyncSearcher::shutdown() {
+    if (stop.exchange(true)) {
+        return;
+    }
+    // the searches that passed their stop check push their query first
+    while (n_pushing.load() > 0) {
+        std::this_thread::yield();
+    }
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        cv.notify_all();
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // a query pushed after the last worker found the queue empty
+    std::unique_ptr<RNNDescentSearchContext> context;
+    std::vector<Request*> batch;
+    Request* request;
+    while (queue.pop(request)) {
+        if (!context) {
+            context.reset(new RNNDescentSearchContext(index));
+        }
+        batch.assign(1, request);
+        run_batch(batch, *context);
+    }
+}
+
+void AsyncSearcher::search(const float* x, idx_t k, Callback callback,
+                           const SearchParametersRNNDescent* params) {
+    std::unique_ptr<Request> request(new Request{
+        std::vector<float>(x, x + index.d), k, std::move(callback),
+        std::chrono::steady_clock::now(),
+        params ? std::make_unique<SearchParametersRNNDescent>(*params)
+               : nullptr});
+
+    n_pushing++;
+    if (stop) {
+        n_pushing--;
+        FAISS_THROW_MSG("the searcher is stopped");
+    }
+    while (!queue.push(request.get())) {
+        std::this_thread::yield();
+    }
+    request.release();
+
+    // pairs with the fence of wait_for_query: either this sees the worker
+    // in n_sleeping, or the worker sees the query before it sleeps
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (n_sleeping.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> guard(mutex);
+        cv.notify_one();
+    }
+    n_pushing--;
+}
+
+std::future<AsyncSearchResult> AsyncSearcher::search(
+    const float* x, idx_t k, const SearchParametersRNNDescent* params) {
+    auto promise = std::make_shared<std::promise<AsyncSearchResult>>();
+    auto future = promise->get_future();
+    search(
+        x, k,
+        [promise](AsyncSearchResult&& result) {
+            if (result.error) {
+                promise->set_exception(result.error);
+            } else {
+                promise->set_value(std::move(result));
+            }
+        },
+        params);
+    return future;
+}
+
+double AsyncSearcher::mean_batch_size() const {
+    size_t nb = n_batches.load();
+    return nb == 0 ? 0.0 : (double)n_queries.load() / nb;
+}
+
+bool AsyncSearcher::wait_for_query(
+    std::chrono::steady_clock::time_point deadline) {
+    auto ready = [&]() { return stop || !queue.empty(); };
+    std::unique_lock<std::mutex> lock(mutex);
+    n_sleeping++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool woken = true;
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+        cv.wait(lock, ready);
+    } else {
+        woken = cv.wait_until(lock, deadline, ready);
+    }
+    n_sleeping--;
+    return woken;
+}
+
+void AsyncSearcher::worker_loop() {
+    RNNDescentSearchContext context(index);
+    std::vector<Request*> batch;
+    batch.reserve(max_batch_size);
+
+    while (true) {
+        Request* request;
+        if (!queue.pop(request)) {
+            // the queue is drained before stopping
+            if (stop) {
+                return;
+            }
+            wait_for_query(std::chrono::steady_clock::time_point::max());
+            continue;
+        }
+
+        batch.assign(1, request);
+        auto deadline = request->arrival + max_wait;
+        while (batch.size() < (size_t)max_batch_size) {
+            if (queue.pop(request)) {
+                batch.push_back(request);
+            } else if (stop || !wait_for_query(deadline)) {
+                break;
+            }
+        }
+
+        run_batch(batch, context);
+        n_queries += batch.size();
+        n_batches++;
+    }
+}
+
+void AsyncSearcher::run_batch(std::vector<Request*>& batch,
+                              RNNDescentSearchContext& context) {
+    const int nb = batch.size();
+    const int d = index.d;
+    std::vector<AsyncSearchResult> results(nb);
+    for (int i = 0; i < nb; i++) {
+        results[i].labels.resize(batch[i]->k);
+        results[i].distances.resize(batch[i]->k);
+    }
+
+    // the queries searched together share their params
+    const SearchParametersRNNDescent* params = batch[0]->params.get();
+    bool same_params = true;
+    for (int i = 1; i < nb && same_params; i++) {
+        same_params = equal_params(batch[i]->params.get(), params);
+    }
+
+    auto fdis = dynamic_cast<FlatDistanceComputer*>(context.dis.get());
+    if (shared_batch_search && fdis && nb > 1 && same_params &&
+        index.rnndescent.search_team_size <= 1) {
+        try {
+            idx_t k = 0;
+            std::vector<float> xb((size_t)nb * d);
+            for (int i = 0; i < nb; i++) {
+                k = std::max(k, batch[i]->k);
+                memcpy(xb.data() + i * d, batch[i]->x.data(),
+                       sizeof(float) * d);
+            }
+            if (index.cosine) {
+                faiss::fvec_renorm_L2(d, nb, xb.data());
+            }
+            std::vector<idx_t> I(nb * k);
+            std::vector<float> D(nb * k);
+            index.rnndescent.search_batch(*fdis, nb, xb.data(), k, I.data(),
+                                          D.data(), context.vt, params);
+
+            bool negate = faiss::is_similarity_metric(index.metric_type);
+            for (int i = 0; i < nb; i++) {
+                for (idx_t j = 0; j < batch[i]->k; j++) {
+                    results[i].labels[j] = I[i * k + j];
+                    results[i].distances[j] =
+                        negate ? -D[i * k + j] : D[i * k + j];
+                }
+            }
+        } catch (...) {
+            for (auto& result : results) {
+                result.error = std::current_exception();
+            }
+        }
+    } else {
+        for (int i = 0; i < nb; i++) {
+            try {
+                index.search_one(batch[i]->x.data(), batch[i]->k,
+                                 results[i].distances.data(),
+                                 results[i].labels.data(), context,
+                                 batch[i]->params.get());
+            } catch (...) {
+                results[i].error = std::current_exception();
+            }
+        }
+    }
+
+    // a callback that throws does not stop the worker nor the delivery of
+    // the other results
+    for (int i = 0; i < nb; i++) {
+        std::unique_ptr<Request> request(batch[i]);
+        try {
+            request->callback(std::move(results[i]));
+        } catch (const std::exception& e) {
+            n_callback_errors++;
+            fprintf(stderr, "WARNING AsyncSearcher callback threw: %s\n",
+                    e.what());
+        } catch (...) {
+            n_callback_errors++;
+            fprintf(stderr, "WARNING AsyncSearcher callback threw\n");
+        }
+    }
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <rnn-descent/IndexRNNDescent.h>
+#include <rnn-descent/MPMCQueue.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rnndescent {
+
+struct AsyncSearchResult {
+    std::vector<idx_t> labels;
+    std::vector<float> distances;
+    std::exception_ptr error;  ///< set if the search failed
+};
+
+/** Asynchronous front-end of an IndexRNNDescent for callers that send
+ * single queries. The queries are queued in a lock-free queue, and each
+ * worker thread takes the queries that arrive within max_wait of the first
+ * one it takes, up to max_batch_size, and searches them with its own
+ * search context. The workers sleep on a condition variable while they
+ * wait for queries. The index must not be modified while the searcher
+ * exists.
+ */
+struct AsyncSearcher {
+    using Callback = std::function<void(AsyncSearchResult&&)>;
+
+    const IndexRNNDescent& index;
+    const int max_batch_size;
+    const std::chrono::microseconds max_wait;
+
+    /// search the batches with RNNDescent::search_batch (flat storages
+    /// only), instead of one query after the other
+    const bool shared_batch_search;
+
+    std::atomic<size_t> n_queries{0};  ///< queries searched
+    std::atomic<size_t> n_batches{0};  ///< batches they were searched in
+    std::atomic<size_t> n_callback_errors{0};  ///< callbacks that threw
+
+    AsyncSearcher(const IndexRNNDescent& index, int n_workers,
+                  int max_batch_size = 16, int max_wait_us = 100,
+                  bool shared_batch_search = false, size_t queue_size = 4096);
+
+    /// Search the queries still queued, then stop the workers. The
+    /// searches that start meanwhile or later throw, those that started
+    /// before get their callback.
+    void shutdown();
+
+    /// calls shutdown
+    ~AsyncSearcher();
+
+    /// the query x and the params are copied, callback is called by a
+    /// worker thread. If it throws, the error is counted in
+    /// n_callback_errors.
+    void search(const float* x, idx_t k, Callback callback,
+                const SearchParametersRNNDescent* params = nullptr);
+
+    std::future<AsyncSearchResult> search(
+        const float* x, idx_t k,
+        const SearchParametersRNNDescent* params = nullptr);
+
+    double mean_batch_size() const;
+
+    struct Request {
+        std::vector<float> x;
+        idx_t k;
+        Callback callback;
+        std::chrono::steady_clock::time_point arrival;
+        std::unique_ptr<SearchParametersRNNDescent> params;  // may be null
+    };
+
+    MPMCQueue<Request*> queue;
+    std::vector<std::thread> workers;
+    std::atomic<bool> stop{false};
+    std::atomic<int> n_pushing{0};  // searches between their stop check and
+                                    // their push
+
+    // the waiting workers sleep on cv. They count themselves in n_sleeping
+    // under the mutex, so a producer that sees n_sleeping == 0 after its
+    // push knows that they will see the query.
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<int> n_sleeping{0};
+
+    void worker_loop();
+
+    /// wait on cv until a query is queued, stop is set or until deadline.
+    /// Returns false on timeout.
+    bool wait_for_query(std::chrono::steady_clock::time_point deadline);
+
+    void run_batch(std::vector<Request*>& batch,
+                   RNNDescentSearchContext& context);
+};
+
+}  // namespace rnndescent
@@ -0,0 +1,120 @@
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexScalarQuantizer.h>
+#include <rnn-descent/DistanceComputer.h>
+#include <rnn-descent/IndexFlatBF16.h>
+
+namespace rnndescent {
+
+namespace {
+
+size_t code_size_of(FlatCodec codec, size_t d) {
+    switch (codec) {
+        case FlatCodec::FP16:
+        case FlatCodec::BF16:
+            return d * 2;
+        case FlatCodec::UInt8:
+        case FlatCodec::SQ8:
+            return d;
+        default:
+            return d * sizeof(float);
+    }
+}
+
+/* The codes c of QT_8bit are decoded as vmin + (c + 0.5) / 255 * vdiff, with
+   per-dimension vmin and vdiff. QT_8bit_uniform has a single vmin and vdiff
+   for all the dimensions. */
+std::vector<float> sq8_params(const faiss::ScalarQuantizer& sq) {
+    size_t d = sq.d;
+    bool uniform = sq.qtype == faiss::ScalarQuantizer::QT_8bit_uniform;
+    std::vector<float> params(2 * d);
+    for (size_t i = 0; i < d; i++) {
+        float vmin = uniform ? sq.trained[0] : sq.trained[i];
+        float vdiff = uniform ? sq.trained[1] : sq.trained[d + i];
+        params[d + i] = vdiff / 255;
+        params[i] = vmin + 0.5f * params[d + i];
+    }
+    return params;
+}
+
+}  // namespace
+
+FlatDistanceComputer::FlatDistanceComputer(FlatCodec codec,
+                                           faiss::MetricType metric, size_t d,
+                                           const uint8_t* codes,
+                                           std::vector<float> params)
+    : codec(codec),
+      metric(metric),
+      d(d),
+      codes(codes),
+      code_size(code_size_of(codec, d)),
+      params(std::move(params)),
+      kernels(&get_flat_kernels(codec, metric)) {}
+
+void FlatDistanceComputer::set_query(const float* x) { q = x; }
+
+float FlatDistanceComputer::operator()(faiss::idx_t i) {
+    return kernels->query_dis(q, codes + i * code_size, d, params.data());
+}
+
+void FlatDistanceComputer::distances_batch_4(
+    const faiss::idx_t idx0, const faiss::idx_t idx1, const faiss::idx_t idx2,
+    const faiss::idx_t idx3, float& dis0, float& dis1, float& dis2,
+    float& dis3) {
+    dis0 = (*this)(idx0);
+    dis1 = (*this)(idx1);
+    dis2 = (*this)(idx2);
+    dis3 = (*this)(idx3);
+}
+
+float FlatDistanceComputer::symmetric_dis(faiss::idx_t i, faiss::idx_t j) {
+    return kernels->symmetric_dis(codes + i * code_size, codes + j * code_size,
+                                  d, params.data());
+}
+
+float FlatDistanceComputer::symmetric_dis_bounded(faiss::idx_t i,
+                                                  faiss::idx_t j,
+                                                  float bound) {
+    return kernels->symmetric_dis_bounded(codes + i * code_size,
+                                          codes + j * code_size, d,
+                                          params.data(), bound);
+}
+
+faiss::DistanceComputer* get_flat_distance_computer(
+    const faiss::Index* storage) {
+    auto metric = storage->metric_type;
+    if (metric != faiss::METRIC_L2 && metric != faiss::METRIC_INNER_PRODUCT) {
+        return nullptr;
+    }
+
+    if (auto flat = dynamic_cast<const faiss::IndexFlat*>(storage)) {
+        return new FlatDistanceComputer(FlatCodec::Float, metric, flat->d,
+                                        flat->codes.data());
+    }
+
+    if (auto bf16 = dynamic_cast<const IndexFlatBF16*>(storage)) {
+        return new FlatDistanceComputer(FlatCodec::BF16, metric, bf16->d,
+                                        bf16->codes.data());
+    }
+
+    if (auto sq = dynamic_cast<const faiss::IndexScalarQuantizer*>(storage)) {
+        switch (sq->sq.qtype) {
+            case faiss::ScalarQuantizer::QT_fp16:
+                return new FlatDistanceComputer(FlatCodec::FP16, metric, sq->d,
+                                                sq->codes.data());
+            case faiss::ScalarQuantizer::QT_8bit_direct:
+                return new FlatDistanceComputer(FlatCodec::UInt8, metric,
+                                                sq->d, sq->codes.data());
+            case faiss::ScalarQuantizer::QT_8bit:
+            case faiss::ScalarQuantizer::QT_8bit_uniform:
+                return new FlatDistanceComputer(FlatCodec::SQ8, metric, sq->d,
+                                                sq->codes.data(),
+                                                sq8_params(sq->sq));
+            default:
+                break;
+        }
+    }
+
+    return nullptr;
+}
+
+}  // namespace rnndescent
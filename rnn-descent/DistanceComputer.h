@@ -0,0 +1,62 @@
+#pragma once
+
+#include <faiss/Index.h>
+#include <faiss/impl/DistanceComputer.h>
+#include <rnn-descent/distances.h>
+
+#include <vector>
+
+namespace rnndescent {
+
+/// DistanceComputer that can stop computing a distance once it is known to
+/// be larger than a bound
+struct BoundedDistanceComputer : faiss::DistanceComputer {
+    /// distance between two stored vectors if it is smaller than bound,
+    /// otherwise any value >= bound
+    virtual float symmetric_dis_bounded(faiss::idx_t i, faiss::idx_t j,
+                                        float bound) {
+        return symmetric_dis(i, j);
+    }
+};
+
+/** Distances on a contiguous array of encoded vectors. Inner products are
+ * negated, so that smaller is better. The virtual calls go through the
+ * kernels of the current SIMD level; the loops of RNNDescent recognize
+ * this class and inline the kernels on codes directly.
+ */
+struct FlatDistanceComputer : BoundedDistanceComputer {
+    FlatCodec codec;
+    faiss::MetricType metric;
+    size_t d;
+    const uint8_t* codes;
+    size_t code_size;
+    std::vector<float> params;  ///< decoding parameters of the codec
+    const float* q = nullptr;
+    const FlatKernels* kernels;
+
+    FlatDistanceComputer(FlatCodec codec, faiss::MetricType metric, size_t d,
+                         const uint8_t* codes,
+                         std::vector<float> params = {});
+
+    void set_query(const float* x) override;
+
+    float operator()(faiss::idx_t i) override;
+
+    void distances_batch_4(const faiss::idx_t idx0, const faiss::idx_t idx1,
+                           const faiss::idx_t idx2, const faiss::idx_t idx3,
+                           float& dis0, float& dis1, float& dis2,
+                           float& dis3) override;
+
+    float symmetric_dis(faiss::idx_t i, faiss::idx_t j) override;
+
+    float symmetric_dis_bounded(faiss::idx_t i, faiss::idx_t j,
+                                float bound) override;
+};
+
+/// Returns a specialized distance computer for IndexFlat, IndexFlatBF16 and
+/// IndexScalarQuantizer (QT_fp16, QT_8bit, QT_8bit_uniform, QT_8bit_direct)
+/// storages, or nullptr
+faiss::DistanceComputer* get_flat_distance_computer(
+    const faiss::Index* storage);
+
+}  // namespace rnndescent
@@ -0,0 +1,179 @@
+/**
+ * The distance computers are based on faiss::IndexBinaryHNSW.cpp
+ * (https://github.com/facebookresearch/faiss/blob/main/faiss/IndexBinaryHNSW.cpp)
+ */
+
+#include <rnn-descent/IndexBinaryRNNDescent.h>
+
+#include <faiss/IndexBinaryFlat.h>
+#include <faiss/impl/AuxIndexStructures.h>
+#include <faiss/impl/DistanceComputer.h>
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/utils/hamming-inl.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+namespace rnndescent {
+
+using namespace faiss;
+
+namespace {
+
+/* Hamming distances between the codes of an IndexBinaryFlat. The query is
+   passed as a float pointer to fit the DistanceComputer interface, it
+   points to code_size bytes. */
+template <class HammingComputer>
+struct FlatHammingDis : DistanceComputer {
+    const int code_size;
+    const uint8_t* b;
+    HammingComputer hc;
+
+    explicit FlatHammingDis(const IndexBinaryFlat& storage)
+        : code_size(storage.code_size), b(storage.xb.data()), hc() {}
+
+    void set_query(const float* x) override {
+        hc.set((const uint8_t*)x, code_size);
+    }
+
+    float operator()(idx_t i) override {
+        return hc.hamming(b + i * code_size);
+    }
+
+    float symmetric_dis(idx_t i, idx_t j) override {
+        return HammingComputer(b + j * code_size, code_size)
+            .hamming(b + i * code_size);
+    }
+};
+
+DistanceComputer* get_hamming_distance_computer(const IndexBinary* storage) {
+    auto flat = dynamic_cast<const IndexBinaryFlat*>(storage);
+    FAISS_THROW_IF_NOT_MSG(flat, "the storage must be an IndexBinaryFlat");
+    switch (flat->code_size) {
+        case 4:
+            return new FlatHammingDis<HammingComputer4>(*flat);
+        case 8:
+            return new FlatHammingDis<HammingComputer8>(*flat);
+        case 16:
+            return new FlatHammingDis<HammingComputer16>(*flat);
+        case 20:
+            return new FlatHammingDis<HammingComputer20>(*flat);
+        case 32:
+            return new FlatHammingDis<HammingComputer32>(*flat);
+        case 64:
+            return new FlatHammingDis<HammingComputer64>(*flat);
+        default:
+            return new FlatHammingDis<HammingComputerDefault>(*flat);
+    }
+}
+
+}  // namespace
+
+/**************************************************************
+ * IndexBinaryRNNDescent implementation
+ **************************************************************/
+
+IndexBinaryRNNDescent::IndexBinaryRNNDescent(int d, int K)
+    : IndexBinary(d),
+      own_fields(true),
+      storage(new IndexBinaryFlat(d)),
+      verbose(false),
+      rnndescent(d) {}
+
+IndexBinaryRNNDescent::IndexBinaryRNNDescent(IndexBinary* storage, int K)
+    : IndexBinary(storage->d),
+      own_fields(false),
+      storage(storage),
+      verbose(false),
+      rnndescent(storage->d) {}
+
+IndexBinaryRNNDescent::~IndexBinaryRNNDescent() {
+    if (own_fields) {
+        delete storage;
+    }
+}
+
+void IndexBinaryRNNDescent::train(idx_t n, const uint8_t* x) {
+    // the graph does not require training
+    storage->train(n, x);
+    is_trained = true;
+}
+
+void IndexBinaryRNNDescent::add(idx_t n, const uint8_t* x) {
+    FAISS_THROW_IF_NOT(is_trained);
+
+    if (ntotal != 0) {
+        fprintf(stderr,
+                "WARNING NNDescent doest not support dynamic insertions,"
+                "multiple insertions would lead to re-building the index");
+    }
+
+    storage->add(n, x);
+    ntotal = storage->ntotal;
+
+    DistanceComputer* dis = get_hamming_distance_computer(storage);
+    ScopeDeleter1<DistanceComputer> del(dis);
+    rnndescent.build(*dis, ntotal, verbose);
+}
+
+void IndexBinaryRNNDescent::search(idx_t n, const uint8_t* x, idx_t k,
+                                   int32_t* distances, idx_t* labels,
+                                   const SearchParameters* params) const {
+    FAISS_THROW_IF_NOT(k > 0);
+
+    const SearchParametersRNNDescent* rparams = nullptr;
+    if (params) {
+        rparams = dynamic_cast<const SearchParametersRNNDescent*>(params);
+        FAISS_THROW_IF_NOT_MSG(rparams, "params type invalid");
+    }
+
+    // the pool holds at least k candidates, also when search_L is 0
+    int search_L = rparams && rparams->search_L > 0 ? rparams->search_L
+                                                    : rnndescent.search_L;
+    idx_t check_period =
+        InterruptCallback::get_period_hint(d * std::max<idx_t>(search_L, k));
+
+    for (idx_t i0 = 0; i0 < n; i0 += check_period) {
+        idx_t i1 = std::min(i0 + check_period, n);
+
+#pragma omp parallel
+        {
+            VisitedTable vt(ntotal);
+
+            DistanceComputer* dis = get_hamming_distance_computer(storage);
+            ScopeDeleter1<DistanceComputer> del(dis);
+
+            std::vector<float> simi(k);
+
+#pragma omp for
+            for (idx_t i = i0; i < i1; i++) {
+                dis->set_query((const float*)(x + i * code_size));
+                rnndescent.search(*dis, k, labels + i * k, simi.data(), vt,
+                                  rparams);
+
+                int32_t* disi = distances + i * k;
+                for (idx_t j = 0; j < k; j++) {
+                    // missing results keep the largest distance
+                    disi[j] = labels[i * k + j] < 0
+                                      ? std::numeric_limits<int32_t>::max()
+                                      : (int32_t)simi[j];
+                }
+            }
+        }
+        InterruptCallback::check();
+    }
+}
+
+void IndexBinaryRNNDescent::reconstruct(idx_t key, uint8_t* recons) const {
+    storage->reconstruct(key, recons);
+}
+
+void IndexBinaryRNNDescent::reset() {
+    rnndescent.reset();
+    storage->reset();
+    ntotal = 0;
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <faiss/IndexBinary.h>
+
+#include <rnn-descent/RNNDescent.h>
+
+namespace rnndescent {
+
+/** RNNDescent graph on binary vectors of d bits, compared with the Hamming
+ * distance. The storage must be an IndexBinaryFlat. The distances in the
+ * candidate pools are the integer Hamming distances, which are exact in
+ * their float representation.
+ */
+struct IndexBinaryRNNDescent : faiss::IndexBinary {
+    bool own_fields;
+    faiss::IndexBinary* storage;
+    bool verbose;
+
+    RNNDescent rnndescent;
+
+    explicit IndexBinaryRNNDescent(int d = 0, int K = 32);
+    explicit IndexBinaryRNNDescent(faiss::IndexBinary* storage, int K = 32);
+
+    ~IndexBinaryRNNDescent() override;
+
+    void add(faiss::idx_t n, const uint8_t* x) override;
+
+    void train(faiss::idx_t n, const uint8_t* x) override;
+
+    /// params may be a SearchParametersRNNDescent
+    void search(faiss::idx_t n, const uint8_t* x, faiss::idx_t k,
+                int32_t* distances, faiss::idx_t* labels,
+                const faiss::SearchParameters* params = nullptr) const override;
+
+    void reconstruct(faiss::idx_t key, uint8_t* recons) const override;
+
+    void reset() override;
+};
+
+}  // namespace rnndescent
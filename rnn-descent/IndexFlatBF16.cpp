@@ -0,0 +1,71 @@
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/utils/Heap.h>
+#include <rnn-descent/DistanceComputer.h>
+#include <rnn-descent/IndexFlatBF16.h>
+
+#include <memory>
+
+namespace rnndescent {
+
+IndexFlatBF16::IndexFlatBF16(faiss::idx_t d, faiss::MetricType metric)
+    : faiss::IndexFlatCodes(d * sizeof(uint16_t), d, metric) {
+    FAISS_THROW_IF_NOT(metric == faiss::METRIC_L2 ||
+                       metric == faiss::METRIC_INNER_PRODUCT);
+}
+
+IndexFlatBF16::IndexFlatBF16() {}
+
+void IndexFlatBF16::sa_encode(faiss::idx_t n, const float* x,
+                              uint8_t* bytes) const {
+    auto codes = (uint16_t*)bytes;
+#pragma omp parallel for if (n > 1000)
+    for (faiss::idx_t i = 0; i < n * d; i++) {
+        codes[i] = encode_bf16(x[i]);
+    }
+}
+
+void IndexFlatBF16::sa_decode(faiss::idx_t n, const uint8_t* bytes,
+                              float* x) const {
+    auto codes = (const uint16_t*)bytes;
+#pragma omp parallel for if (n > 1000)
+    for (faiss::idx_t i = 0; i < n * d; i++) {
+        x[i] = decode_bf16(codes[i]);
+    }
+}
+
+void IndexFlatBF16::search(faiss::idx_t n, const float* x, faiss::idx_t k,
+                           float* distances, faiss::idx_t* labels,
+                           const faiss::SearchParameters* params) const {
+    FAISS_THROW_IF_NOT_MSG(!params,
+                           "search params not supported for this index");
+    FAISS_THROW_IF_NOT(k > 0);
+
+#pragma omp parallel
+    {
+        // inner products are negated, so a max-heap works for both metrics
+        std::unique_ptr<faiss::DistanceComputer> dis(
+            get_flat_distance_computer(this));
+
+#pragma omp for
+        for (faiss::idx_t i = 0; i < n; i++) {
+            float* simi = distances + i * k;
+            faiss::idx_t* idxi = labels + i * k;
+            faiss::maxheap_heapify(k, simi, idxi);
+            dis->set_query(x + i * d);
+            for (faiss::idx_t j = 0; j < ntotal; j++) {
+                float dij = (*dis)(j);
+                if (dij < simi[0]) {
+                    faiss::maxheap_replace_top(k, simi, idxi, dij, j);
+                }
+            }
+            faiss::maxheap_reorder(k, simi, idxi);
+            if (metric_type == faiss::METRIC_INNER_PRODUCT) {
+                for (faiss::idx_t j = 0; j < k; j++) {
+                    simi[j] = -simi[j];
+                }
+            }
+        }
+    }
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <faiss/IndexFlatCodes.h>
+
+namespace rnndescent {
+
+/** Flat storage of the vectors in bfloat16. It has the range of float32 with
+ * 8 bits of mantissa, and halves the memory of IndexFlat. The distances are
+ * computed on the codes directly, see get_flat_distance_computer.
+ */
+struct IndexFlatBF16 : faiss::IndexFlatCodes {
+    explicit IndexFlatBF16(faiss::idx_t d,
+                           faiss::MetricType metric = faiss::METRIC_L2);
+
+    IndexFlatBF16();
+
+    void sa_encode(faiss::idx_t n, const float* x,
+                   uint8_t* bytes) const override;
+
+    void sa_decode(faiss::idx_t n, const uint8_t* bytes,
+                   float* x) const override;
+
+    /// exhaustive search
+    void search(faiss::idx_t n, const float* x, faiss::idx_t k,
+                float* distances, faiss::idx_t* labels,
+                const faiss::SearchParameters* params = nullptr) const override;
+};
+
+}  // namespace rnndescent
@@ -6,33 +6,31 @@
 // -*- c++ -*-
 
 #include <omp.h>
+#include <rnn-descent/DistanceComputer.h>
+#include <rnn-descent/IndexFlatBF16.h>
 #include <rnn-descent/IndexRNNDescent.h>
+#include <rnn-descent/huge_pages.h>
+#include <rnn-descent/numa.h>
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <queue>
 #include <unordered_set>
 
-#ifdef __SSE__
-#endif
-
 #include <faiss/IndexFlat.h>
+#include <faiss/IndexFlatCodes.h>
 #include <faiss/impl/AuxIndexStructures.h>
 #include <faiss/impl/FaissAssert.h>
 #include <faiss/utils/Heap.h>
 #include <faiss/utils/distances.h>
 #include <faiss/utils/random.h>
 
-extern "C" {
-
-/* declare BLAS functions, see http://www.netlib.org/clapack/cblas/ */
-
-int sgemm_(const char* transa, const char* transb, FINTEGER* m, FINTEGER* n,
-           FINTEGER* k, const float* alpha, const float* a, FINTEGER* lda,
-           const float* b, FINTEGER* ldb, float* beta, float* c, FINTEGER* ldc);
-}
-
 namespace rnndescent {
 
 using namespace faiss;
@@ -68,7 +66,14 @@ struct NegativeDistanceComputer : DistanceComputer {
     ~NegativeDistanceComputer() override { delete basedis; }
 };
 
+}  // namespace
+
 DistanceComputer* storage_distance_computer(const Index* storage) {
+    // the specialized computers negate the inner products themselves and
+    // are called without virtual calls by RNNDescent
+    if (auto dis = get_flat_distance_computer(storage)) {
+        return dis;
+    }
     if (is_similarity_metric(storage->metric_type)) {
         return new NegativeDistanceComputer(storage->get_distance_computer());
     } else {
@@ -76,6 +81,78 @@ DistanceComputer* storage_distance_computer(const Index* storage) {
     }
 }
 
+namespace {
+
+/* The normalized vectors only rank by cosine similarity with inner
+   products */
+void check_cosine(const IndexRNNDescent& index) {
+    FAISS_THROW_IF_NOT_MSG(
+        !index.cosine || index.metric_type == METRIC_INNER_PRODUCT,
+        "cosine requires METRIC_INNER_PRODUCT");
+}
+
+/* Returns x, or a normalized copy of it in buf for cosine indexes */
+const float* normalize_if_cosine(bool cosine, idx_t n, int d, const float* x,
+                                 std::vector<float>& buf) {
+    if (!cosine) {
+        return x;
+    }
+    buf.assign(x, x + n * d);
+    fvec_renorm_L2(d, n, buf.data());
+    return buf.data();
+}
+
+/* Codes of the flat storages, which the distance computers can read from
+   another copy */
+std::vector<uint8_t>* flat_codes(Index* storage) {
+    auto flat = dynamic_cast<IndexFlatCodes*>(storage);
+    return flat ? &flat->codes : nullptr;
+}
+
+void interleave_storage(Index* storage) {
+    if (auto codes = flat_codes(storage)) {
+        numa_interleave_memory(codes->data(), codes->size());
+    }
+}
+
+/* Remove the vectors i with removed[i] set from the storage */
+void compact_storage(Index* storage, const std::vector<bool>& removed) {
+    if (auto codes = flat_codes(storage)) {
+        const size_t code_size = storage->sa_code_size();
+        idx_t j = 0;
+        for (idx_t i = 0; i < storage->ntotal; i++) {
+            if (!removed[i]) {
+                if (j != i) {
+                    memcpy(codes->data() + j * code_size,
+                           codes->data() + i * code_size, code_size);
+                }
+                j++;
+            }
+        }
+        codes->resize(j * code_size);
+        storage->ntotal = j;
+        return;
+    }
+    // the other storages are filled again with the decoded vectors
+    std::vector<float> kept;
+    std::vector<float> buf(storage->d);
+    for (idx_t i = 0; i < storage->ntotal; i++) {
+        if (!removed[i]) {
+            storage->reconstruct(i, buf.data());
+            kept.insert(kept.end(), buf.begin(), buf.end());
+        }
+    }
+    storage->reset();
+    storage->add(kept.size() / storage->d, kept.data());
+}
+
+void interleave_graph(const RNNDescent& rnndescent) {
+    numa_interleave_memory(rnndescent.final_graph.data(),
+                           rnndescent.final_graph.size() * sizeof(int));
+    numa_interleave_memory(rnndescent.offsets.data(),
+                           rnndescent.offsets.size() * sizeof(int));
+}
+
 }  // namespace
 
 /**************************************************************
@@ -87,13 +164,16 @@ IndexRNNDescent::IndexRNNDescent(int d, int K, MetricType metric)
     // the default storage is IndexFlat
     storage = new IndexFlat(d, metric);
     own_fields = true;
+    rnndescent.metric_type = metric;
 }
 
 IndexRNNDescent::IndexRNNDescent(Index* storage, int K)
     : Index(storage->d, storage->metric_type),
       rnndescent(storage->d),
       own_fields(false),
-      storage(storage) {}
+      storage(storage) {
+    rnndescent.metric_type = storage->metric_type;
+}
 
 IndexRNNDescent::~IndexRNNDescent() {
     if (own_fields) {
@@ -113,12 +193,42 @@ void IndexRNNDescent::train(idx_t n, const float* x) {
 void IndexRNNDescent::search(idx_t n, const float* x, idx_t k, float* distances,
                              idx_t* labels,
                              const SearchParameters* params) const {
-    FAISS_THROW_IF_NOT_MSG(!params,
-                           "search params not supported for this index");
     FAISS_THROW_IF_NOT(storage);
+    check_cosine(*this);
+
+    const SearchParametersRNNDescent* rparams = nullptr;
+    if (params) {
+        rparams = dynamic_cast<const SearchParametersRNNDescent*>(params);
+        FAISS_THROW_IF_NOT_MSG(rparams, "params type invalid");
+    }
+
+    if (query_cache) {
+        search_with_cache(n, x, k, distances, labels, rparams);
+    } else {
+        search_graph(n, x, k, distances, labels, rparams);
+    }
+}
 
+void IndexRNNDescent::search_graph(idx_t n, const float* x, idx_t k,
+                                   float* distances, idx_t* labels,
+                                   const SearchParametersRNNDescent* rparams)
+    const {
+    if (rnndescent.search_team_size > 1) {
+        search_with_teams(n, x, k, distances, labels, rparams);
+        return;
+    }
+    if (n == 1 && numa_replicas.empty()) {
+        // not worth a parallel region
+        RNNDescentSearchContext context(*this);
+        search_one(x, k, distances, labels, context, rparams);
+        return;
+    }
+
+    // the pool holds at least k candidates, also when search_L is 0
+    int search_L = rparams && rparams->search_L > 0 ? rparams->search_L
+                                                    : rnndescent.search_L;
     idx_t check_period =
-        InterruptCallback::get_period_hint(d * rnndescent.search_L);
+        InterruptCallback::get_period_hint(d * std::max<idx_t>(search_L, k));
 
     for (idx_t i0 = 0; i0 < n; i0 += check_period) {
         idx_t i1 = std::min(i0 + check_period, n);
@@ -130,24 +240,339 @@ void IndexRNNDescent::search(idx_t n, const float* x, idx_t k, float* distances,
             DistanceComputer* dis = storage_distance_computer(storage);
             ScopeDeleter1<DistanceComputer> del(dis);
 
+            const RNNDescent* rd = &rnndescent;
+            if (!numa_replicas.empty()) {
+                auto& replica = numa_replicas[numa_current_node() %
+                                              numa_replicas.size()];
+                rd = &replica.rnndescent;
+                auto fdis = dynamic_cast<FlatDistanceComputer*>(dis);
+                if (fdis && !replica.codes.empty()) {
+                    fdis->codes = replica.codes.data();
+                }
+            }
+
+            std::vector<float> qnorm(cosine ? d : 0);
+
 #pragma omp for
             for (idx_t i = i0; i < i1; i++) {
                 idx_t* idxi = labels + i * k;
                 float* simi = distances + i * k;
+                if (cosine) {
+                    memcpy(qnorm.data(), x + i * d, sizeof(float) * d);
+                    fvec_renorm_L2(d, 1, qnorm.data());
+                    dis->set_query(qnorm.data());
+                } else {
+                    dis->set_query(x + i * d);
+                }
+
+                rd->search(*dis, k, idxi, simi, vt, rparams);
+
+                if (is_similarity_metric(metric_type)) {
+                    // we need to revert the negated distances
+                    for (idx_t j = 0; j < k; j++) {
+                        simi[j] = -simi[j];
+                    }
+                }
+            }
+        }
+        InterruptCallback::check();
+    }
+}
+
+void IndexRNNDescent::range_search(idx_t n, const float* x, float radius,
+                                   RangeSearchResult* result,
+                                   const SearchParameters* params) const {
+    FAISS_THROW_IF_NOT(storage);
+    check_cosine(*this);
+
+    const SearchParametersRNNDescent* rparams = nullptr;
+    if (params) {
+        rparams = dynamic_cast<const SearchParametersRNNDescent*>(params);
+        FAISS_THROW_IF_NOT_MSG(rparams, "params type invalid");
+    }
+
+    // the graph works on negated inner products
+    const bool negate = is_similarity_metric(metric_type);
+    const float graph_radius = negate ? -radius : radius;
+
+#pragma omp parallel
+    {
+        VisitedTable vt(ntotal);
+        DistanceComputer* dis = storage_distance_computer(storage);
+        ScopeDeleter1<DistanceComputer> del(dis);
+        std::vector<float> qnorm(cosine ? d : 0);
+
+        // the results of the thread are appended to the buffers of pres,
+        // found is reused by its queries
+        RangeSearchPartialResult pres(result);
+        std::vector<nndescent::Neighbor> found;
+
+#pragma omp for schedule(dynamic)
+        for (idx_t i = 0; i < n; i++) {
+            if (cosine) {
+                memcpy(qnorm.data(), x + i * d, sizeof(float) * d);
+                fvec_renorm_L2(d, 1, qnorm.data());
+                dis->set_query(qnorm.data());
+            } else {
                 dis->set_query(x + i * d);
+            }
 
-                rnndescent.search(*dis, k, idxi, simi, vt);
+            found.clear();
+            rnndescent.range_search(*dis, graph_radius, found, vt, rparams);
+
+            RangeQueryResult& qres = pres.new_result(i);
+            for (auto&& nn : found) {
+                qres.add(negate ? -nn.distance : nn.distance, nn.id);
             }
         }
-        InterruptCallback::check();
+        pres.finalize();
     }
+}
 
-    if (metric_type == METRIC_INNER_PRODUCT) {
-        // we need to revert the negated distances
-        for (size_t i = 0; i < k * n; i++) {
-            distances[i] = -distances[i];
+void IndexRNNDescent::search_with_cache(
+    idx_t n, const float* x, idx_t k, float* distances, idx_t* labels,
+    const SearchParametersRNNDescent* params) const {
+    const int search_L = params && params->search_L > 0
+                                 ? params->search_L
+                                 : rnndescent.search_L;
+    std::vector<QueryCache::Key> keys(n);
+    std::vector<char> hit(n);
+#pragma omp parallel for if (n > 64)
+    for (idx_t i = 0; i < n; i++) {
+        keys[i] = query_cache->make_key(x + i * d, k, search_L, params);
+        hit[i] = query_cache->lookup(keys[i], distances + i * k,
+                                     labels + i * k);
+    }
+
+    std::vector<idx_t> misses;
+    for (idx_t i = 0; i < n; i++) {
+        if (!hit[i]) {
+            misses.push_back(i);
+        }
+    }
+    const idx_t nm = misses.size();
+    if (nm == n) {
+        search_graph(n, x, k, distances, labels, params);
+    } else if (nm > 0) {
+        std::vector<float> xm(nm * d);
+        std::vector<float> Dm(nm * k);
+        std::vector<idx_t> Im(nm * k);
+        for (idx_t j = 0; j < nm; j++) {
+            memcpy(xm.data() + j * d, x + misses[j] * d, sizeof(float) * d);
+        }
+        search_graph(nm, xm.data(), k, Dm.data(), Im.data(), params);
+        for (idx_t j = 0; j < nm; j++) {
+            memcpy(distances + misses[j] * k, Dm.data() + j * k,
+                   sizeof(float) * k);
+            memcpy(labels + misses[j] * k, Im.data() + j * k,
+                   sizeof(idx_t) * k);
         }
     }
+
+    for (idx_t i : misses) {
+        query_cache->insert(std::move(keys[i]), distances + i * k,
+                            labels + i * k);
+    }
+}
+
+void IndexRNNDescent::search_with_teams(idx_t n, const float* x, idx_t k,
+                                        float* distances, idx_t* labels,
+                                        const SearchParametersRNNDescent*
+                                            params) const {
+    const int team_size = rnndescent.search_team_size;
+    std::vector<std::unique_ptr<DistanceComputer>> team(team_size);
+    std::vector<DistanceComputer*> team_dis(team_size);
+    for (int t = 0; t < team_size; t++) {
+        team[t].reset(storage_distance_computer(storage));
+        team_dis[t] = team[t].get();
+    }
+    VisitedTable vt(ntotal);
+    std::vector<float> qnorm(cosine ? d : 0);
+
+    for (idx_t i = 0; i < n; i++) {
+        const float* q = x + i * d;
+        if (cosine) {
+            memcpy(qnorm.data(), q, sizeof(float) * d);
+            fvec_renorm_L2(d, 1, qnorm.data());
+            q = qnorm.data();
+        }
+        for (auto dis : team_dis) {
+            dis->set_query(q);
+        }
+
+        float* simi = distances + i * k;
+        rnndescent.search_parallel(team_dis.data(), team_size, k,
+                                   labels + i * k, simi, vt, params);
+
+        if (is_similarity_metric(metric_type)) {
+            for (idx_t j = 0; j < k; j++) {
+                simi[j] = -simi[j];
+            }
+        }
+        if (i % 16 == 15) {
+            InterruptCallback::check();
+        }
+    }
+}
+
+RNNDescentSearchContext::RNNDescentSearchContext(const IndexRNNDescent& index)
+    : vt(index.ntotal),
+      dis(storage_distance_computer(index.storage)),
+      qnorm(index.cosine ? index.d : 0) {}
+
+void IndexRNNDescent::search_one(const float* x, idx_t k, float* distances,
+                                 idx_t* labels,
+                                 RNNDescentSearchContext& context,
+                                 const SearchParametersRNNDescent* params)
+    const {
+    FAISS_THROW_IF_NOT(k > 0);
+    FAISS_THROW_IF_NOT_MSG(rnndescent.has_built, "The index is not build yet.");
+    FAISS_THROW_IF_NOT_MSG(context.vt.visited.size() == (size_t)ntotal,
+                           "the search context is older than the index");
+    check_cosine(*this);
+
+    if (cosine) {
+        memcpy(context.qnorm.data(), x, sizeof(float) * d);
+        fvec_renorm_L2(d, 1, context.qnorm.data());
+        x = context.qnorm.data();
+    }
+    context.dis->set_query(x);
+    rnndescent.search(*context.dis, k, labels, distances, context.vt, params);
+
+    if (is_similarity_metric(metric_type)) {
+        for (idx_t j = 0; j < k; j++) {
+            distances[j] = -distances[j];
+        }
+    }
+}
+
+void IndexRNNDescent::search_with_executor(
+    idx_t n, const float* x, idx_t k, float* distances, idx_t* labels,
+    const SearchExecutor& executor,
+    const SearchParametersRNNDescent* params) const {
+    FAISS_THROW_IF_NOT(storage);
+    const idx_t task_size = 16;
+    const size_t n_tasks = (n + task_size - 1) / task_size;
+
+    // the contexts are reused by the tasks that run one after the other,
+    // since the executor does not tell which thread runs a task
+    std::mutex mutex;
+    std::vector<std::unique_ptr<RNNDescentSearchContext>> free_contexts;
+
+    executor(n_tasks, [&](size_t task) {
+        std::unique_ptr<RNNDescentSearchContext> context;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!free_contexts.empty()) {
+                context = std::move(free_contexts.back());
+                free_contexts.pop_back();
+            }
+        }
+        if (!context) {
+            context.reset(new RNNDescentSearchContext(*this));
+        }
+
+        idx_t i1 = std::min<idx_t>((task + 1) * task_size, n);
+        for (idx_t i = task * task_size; i < i1; i++) {
+            search_one(x + i * d, k, distances + i * k, labels + i * k,
+                       *context, params);
+        }
+
+        std::lock_guard<std::mutex> guard(mutex);
+        free_contexts.push_back(std::move(context));
+    });
+}
+
+bool IndexRNNDescent::search_with_batches(
+    idx_t n, const float* x, idx_t k, float* distances, idx_t* labels,
+    const SearchParametersRNNDescent* params) const {
+    FAISS_THROW_IF_NOT(storage);
+    FAISS_THROW_IF_NOT(k > 0);
+    check_cosine(*this);
+    // the batches are only made of close queries when they are grouped by
+    // entry point
+    if (rnndescent.levels.empty()) {
+        return false;
+    }
+    {
+        std::unique_ptr<DistanceComputer> dis(
+            storage_distance_computer(storage));
+        if (!dynamic_cast<FlatDistanceComputer*>(dis.get())) {
+            return false;
+        }
+    }
+
+    std::vector<float> xnorm;
+    const float* xq = normalize_if_cosine(cosine, n, d, x, xnorm);
+
+    // the queries with the same entry point share most of their search
+    std::vector<idx_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::vector<int> entries(n);
+#pragma omp parallel
+    {
+        std::unique_ptr<DistanceComputer> dis(
+            storage_distance_computer(storage));
+#pragma omp for
+        for (idx_t i = 0; i < n; i++) {
+            dis->set_query(xq + i * d);
+            entries[i] = rnndescent.entry_point(*dis);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](idx_t a, idx_t b) {
+        return entries[a] < entries[b];
+    });
+
+    const int batch_size = rnndescent.search_batch_size;
+    const idx_t n_batches = (n + batch_size - 1) / batch_size;
+    int search_L = params && params->search_L > 0 ? params->search_L
+                                                  : rnndescent.search_L;
+    idx_t check_period = std::max<idx_t>(
+        1,
+        InterruptCallback::get_period_hint(d * std::max<idx_t>(search_L, k)) /
+            batch_size);
+
+    for (idx_t b0 = 0; b0 < n_batches; b0 += check_period) {
+        idx_t b1 = std::min(b0 + check_period, n_batches);
+
+#pragma omp parallel
+        {
+            VisitedTable vt(ntotal);
+            std::unique_ptr<DistanceComputer> dis(
+                storage_distance_computer(storage));
+            auto& fdis = dynamic_cast<FlatDistanceComputer&>(*dis);
+
+            std::vector<float> xb((size_t)batch_size * d);
+            std::vector<idx_t> I((size_t)batch_size * k);
+            std::vector<float> D((size_t)batch_size * k);
+
+#pragma omp for schedule(dynamic)
+            for (idx_t b = b0; b < b1; b++) {
+                idx_t i0 = b * batch_size;
+                int nb = std::min<idx_t>(batch_size, n - i0);
+                for (int j = 0; j < nb; j++) {
+                    memcpy(xb.data() + j * d, xq + order[i0 + j] * d,
+                           sizeof(float) * d);
+                }
+
+                rnndescent.search_batch(fdis, nb, xb.data(), k, I.data(),
+                                        D.data(), vt, params);
+
+                for (int j = 0; j < nb; j++) {
+                    idx_t i = order[i0 + j];
+                    for (idx_t l = 0; l < k; l++) {
+                        labels[i * k + l] = I[j * k + l];
+                        distances[i * k + l] =
+                            is_similarity_metric(metric_type)
+                                ? -D[j * k + l]
+                                : D[j * k + l];
+                    }
+                }
+            }
+        }
+        InterruptCallback::check();
+    }
+    return true;
 }
 
 void IndexRNNDescent::add(idx_t n, const float* x) {
@@ -155,6 +580,7 @@ void IndexRNNDescent::add(idx_t n, const float* x) {
                            "Please use IndexNNDescentFlat (or variants) "
                            "instead of IndexNNDescent directly");
     FAISS_THROW_IF_NOT(is_trained);
+    check_cosine(*this);
 
     if (ntotal != 0) {
         fprintf(stderr,
@@ -162,22 +588,303 @@ void IndexRNNDescent::add(idx_t n, const float* x) {
                 "multiple insertions would lead to re-building the index");
     }
 
-    storage->add(n, x);
+    std::vector<float> xnorm;
+    storage->add(n, normalize_if_cosine(cosine, n, d, x, xnorm));
     ntotal = storage->ntotal;
+    numa_replicas.clear();
+    if (query_cache) {
+        query_cache->clear();
+    }
+    if (numa_interleave) {
+        interleave_storage(storage);
+    }
+
+    // the clustering initialization and the proxy need the whole database
+    const float* xb = nullptr;
+    std::vector<float> recons;
+    if (rnndescent.init_with_clustering || build_with_sq8_proxy) {
+        auto* flat = dynamic_cast<IndexFlat*>(storage);
+        if (flat) {
+            xb = flat->get_xb();
+        } else {
+            recons.resize((size_t)ntotal * d);
+            storage->reconstruct_n(0, ntotal, recons.data());
+            xb = recons.data();
+        }
+    }
+
+    DistanceComputer* dis = storage_distance_computer(storage);
+    ScopeDeleter1<DistanceComputer> del(dis);
+
+    if (!build_with_sq8_proxy) {
+        rnndescent.build(*dis, ntotal, verbose, xb);
+    } else {
+        IndexScalarQuantizer proxy(d, ScalarQuantizer::QT_8bit, metric_type);
+        proxy.train(ntotal, xb);
+        proxy.add(ntotal, xb);
+        DistanceComputer* proxy_dis = storage_distance_computer(&proxy);
+        ScopeDeleter1<DistanceComputer> del_proxy(proxy_dis);
+        rnndescent.build_with_proxy(*proxy_dis, *dis, ntotal, verbose, xb);
+    }
+    if (numa_interleave) {
+        interleave_graph(rnndescent);
+    }
+    if (huge_pages) {
+        enable_huge_pages();
+    }
+}
+
+void IndexRNNDescent::add_with_knn_graph(idx_t n, const float* x,
+                                         const idx_t* knn_graph, int k) {
+    FAISS_THROW_IF_NOT_MSG(storage,
+                           "Please use IndexNNDescentFlat (or variants) "
+                           "instead of IndexNNDescent directly");
+    FAISS_THROW_IF_NOT(is_trained);
+    check_cosine(*this);
+    FAISS_THROW_IF_NOT(k > 0);
+
+    std::vector<float> xnorm;
+    storage->add(n, normalize_if_cosine(cosine, n, d, x, xnorm));
+    ntotal = storage->ntotal;
+    numa_replicas.clear();
+    if (query_cache) {
+        query_cache->clear();
+    }
+    if (numa_interleave) {
+        interleave_storage(storage);
+    }
+
+    DistanceComputer* dis = storage_distance_computer(storage);
+    ScopeDeleter1<DistanceComputer> del(dis);
+    rnndescent.build_from_knn_graph(*dis, ntotal, knn_graph, k, verbose);
+    if (numa_interleave) {
+        interleave_graph(rnndescent);
+    }
+    if (huge_pages) {
+        enable_huge_pages();
+    }
+}
+
+void IndexRNNDescent::update_vectors(idx_t n, const float* x,
+                                     const std::vector<bool>& removed) {
+    FAISS_THROW_IF_NOT(storage);
+    FAISS_THROW_IF_NOT(removed.size() == (size_t)ntotal);
+    check_cosine(*this);
+    const idx_t n_keep = std::count(removed.begin(), removed.end(), false);
+
+    if (!rnndescent.has_built || n_keep == 0) {
+        // no graph to start from
+        compact_storage(storage, removed);
+        ntotal = storage->ntotal;
+        rnndescent.reset();
+        numa_replicas.clear();
+        if (query_cache) {
+            query_cache->clear();
+        }
+        if (n > 0) {
+            add(n, x);
+        }
+        return;
+    }
+
+    // the candidate neighbors of the new vectors are searched in the
+    // current graph, then renumbered. K0 may exceed the out-degrees (it
+    // only truncates the neighbor lists of the search).
+    const auto& offsets = rnndescent.offsets;
+    int max_degree = 1;
+    for (idx_t i = 0; i < ntotal; i++) {
+        max_degree = std::max(max_degree, offsets[i + 1] - offsets[i]);
+    }
+    const int k = std::min(rnndescent.K0, max_degree);
+    std::vector<idx_t> add_knn(n * k);
+    if (n > 0) {
+        std::vector<float> D(n * k);
+        search(n, x, k, D.data(), add_knn.data());
+        std::vector<idx_t> new_id(ntotal, -1);
+        for (idx_t i = 0, j = 0; i < ntotal; i++) {
+            if (!removed[i]) {
+                new_id[i] = j++;
+            }
+        }
+        for (auto& id : add_knn) {
+            id = id >= 0 ? new_id[id] : -1;
+        }
+    }
+
+    compact_storage(storage, removed);
+    std::vector<float> xnorm;
+    storage->add(n, normalize_if_cosine(cosine, n, d, x, xnorm));
+    ntotal = storage->ntotal;
+    numa_replicas.clear();
+    if (query_cache) {
+        query_cache->clear();
+    }
+    if (numa_interleave) {
+        interleave_storage(storage);
+    }
 
     DistanceComputer* dis = storage_distance_computer(storage);
     ScopeDeleter1<DistanceComputer> del(dis);
-    rnndescent.build(*dis, ntotal, verbose);
+    rnndescent.update_graph(*dis, removed, n, add_knn.data(), k, verbose);
+    if (numa_interleave) {
+        interleave_graph(rnndescent);
+    }
+    if (huge_pages) {
+        enable_huge_pages();
+    }
 }
 
 void IndexRNNDescent::reset() {
     rnndescent.reset();
+    numa_replicas.clear();
+    if (query_cache) {
+        query_cache->clear();
+    }
     storage->reset();
     ntotal = 0;
 }
 
+void IndexRNNDescent::merge_from(Index& otherIndex, idx_t add_id) {
+    FAISS_THROW_IF_NOT_MSG(add_id == 0, "cannot set ids in IndexRNNDescent");
+    check_compatible_for_merge(otherIndex);
+    auto& other = static_cast<IndexRNNDescent&>(otherIndex);
+
+    storage->merge_from(*other.storage);
+    ntotal = storage->ntotal;
+    numa_replicas.clear();
+    if (query_cache) {
+        query_cache->clear();
+    }
+    if (numa_interleave) {
+        interleave_storage(storage);
+    }
+
+    DistanceComputer* dis = storage_distance_computer(storage);
+    ScopeDeleter1<DistanceComputer> del(dis);
+    rnndescent.merge_from(*dis, other.rnndescent, verbose);
+    if (numa_interleave) {
+        interleave_graph(rnndescent);
+    }
+    if (huge_pages) {
+        enable_huge_pages();
+    }
+
+    other.rnndescent.reset();
+    other.ntotal = 0;
+    if (other.query_cache) {
+        other.query_cache->clear();
+    }
+}
+
+void IndexRNNDescent::check_compatible_for_merge(
+    const Index& otherIndex) const {
+    auto other = dynamic_cast<const IndexRNNDescent*>(&otherIndex);
+    FAISS_THROW_IF_NOT(other);
+    FAISS_THROW_IF_NOT(other->d == d);
+    FAISS_THROW_IF_NOT(other->metric_type == metric_type);
+    FAISS_THROW_IF_NOT(other->cosine == cosine);
+    FAISS_THROW_IF_NOT(storage && other->storage);
+    storage->check_compatible_for_merge(*other->storage);
+    // checked before the storages are merged, an empty side needs no graph
+    FAISS_THROW_IF_NOT_MSG(
+        (ntotal == 0 || rnndescent.has_built) &&
+            (other->ntotal == 0 || other->rnndescent.has_built),
+        "The index is not build yet.");
+}
+
+void IndexRNNDescent::replicate_for_numa() {
+    FAISS_THROW_IF_NOT_MSG(rnndescent.has_built,
+                           "The index is not build yet.");
+    numa_replicas.clear();
+    int n_nodes = numa_num_nodes();
+    if (n_nodes <= 1) {
+        return;
+    }
+
+    const std::vector<uint8_t>* codes = flat_codes(storage);
+    numa_replicas.reserve(n_nodes);
+    for (int node = 0; node < n_nodes; node++) {
+        // the copies are first touched by a thread of the node
+        numa_run_on_node(node, [&] {
+            numa_replicas.push_back({node, rnndescent, {}});
+            if (codes) {
+                numa_replicas.back().codes = *codes;
+            }
+        });
+    }
+    if (huge_pages) {
+        enable_huge_pages();
+    }
+}
+
+void IndexRNNDescent::enable_query_cache(size_t capacity,
+                                         float quantization_step,
+                                         int n_shards) {
+    query_cache.reset(
+        new QueryCache(d, capacity, quantization_step, n_shards));
+}
+
+bool IndexRNNDescent::enable_huge_pages() {
+    // the arrays smaller than a huge page count as backed
+    bool ok = true;
+    auto advise_graph = [&](const RNNDescent& rd) {
+        ok &= advise_huge_pages(rd.final_graph.data(),
+                                rd.final_graph.size() * sizeof(int));
+        ok &= advise_huge_pages(rd.offsets.data(),
+                                rd.offsets.size() * sizeof(int));
+    };
+    if (auto codes = flat_codes(storage)) {
+        ok &= advise_huge_pages(codes->data(), codes->size());
+    }
+    advise_graph(rnndescent);
+    for (auto& replica : numa_replicas) {
+        ok &= advise_huge_pages(replica.codes.data(), replica.codes.size());
+        advise_graph(replica.rnndescent);
+    }
+    if (verbose && !ok) {
+        printf("Huge pages are not available\n");
+    }
+    return ok;
+}
+
+void IndexRNNDescent::compute_knn_graph(
+    idx_t k, idx_t* labels, float* distances,
+    const SearchParametersRNNDescent* params) const {
+    FAISS_THROW_IF_NOT(storage);
+    DistanceComputer* dis = storage_distance_computer(storage);
+    ScopeDeleter1<DistanceComputer> del(dis);
+    rnndescent.compute_knn_graph(*dis, k, labels, distances, params);
+
+    if (is_similarity_metric(metric_type)) {
+        for (size_t i = 0; i < (size_t)ntotal * k; i++) {
+            distances[i] = -distances[i];
+        }
+    }
+}
+
 void IndexRNNDescent::reconstruct(idx_t key, float* recons) const {
     storage->reconstruct(key, recons);
 }
 
+/**************************************************************
+ * IndexRNNDescentSQ implementation
+ **************************************************************/
+
+IndexRNNDescentSQ::IndexRNNDescentSQ(int d,
+                                     ScalarQuantizer::QuantizerType qtype,
+                                     int K, MetricType metric)
+    : IndexRNNDescent(new IndexScalarQuantizer(d, qtype, metric), K) {
+    is_trained = storage->is_trained;
+    own_fields = true;
+}
+
+/**************************************************************
+ * IndexRNNDescentBF16 implementation
+ **************************************************************/
+
+IndexRNNDescentBF16::IndexRNNDescentBF16(int d, int K, MetricType metric)
+    : IndexRNNDescent(new IndexFlatBF16(d, metric), K) {
+    own_fields = true;
+}
+
 }  // namespace rnndescent
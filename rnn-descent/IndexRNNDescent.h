@@ -1,18 +1,83 @@
+#pragma once
+
 #include <faiss/Index.h>
+#include <faiss/IndexScalarQuantizer.h>
+#include <faiss/impl/AuxIndexStructures.h>
+#include <faiss/impl/DistanceComputer.h>
 
+#include <rnn-descent/QueryCache.h>
 #include <rnn-descent/RNNDescent.h>
 
+#include <functional>
+#include <memory>
+
 namespace rnndescent {
 
 using idx_t = faiss::idx_t;
 
+struct IndexRNNDescent;
+
+/// Distance computer of the vectors of storage, as the graph is built and
+/// searched with: the inner products are negated and the flat storages get
+/// their specialized computer. Owned by the caller.
+faiss::DistanceComputer* storage_distance_computer(const faiss::Index* storage);
+
+/** State of IndexRNNDescent::search_one, to be reused by the queries of one
+ * thread. It must be created again when vectors are added to the index.
+ */
+struct RNNDescentSearchContext {
+    faiss::VisitedTable vt;
+    std::unique_ptr<faiss::DistanceComputer> dis;
+    std::vector<float> qnorm;  // normalized query of a cosine index
+
+    explicit RNNDescentSearchContext(const IndexRNNDescent& index);
+};
+
+/// Runs task(i) for i in [0, n_tasks), possibly in parallel, and returns
+/// when all of them are done
+using SearchExecutor = std::function<void(
+    size_t n_tasks, const std::function<void(size_t)>& task)>;
+
+/// Copy of the graph and of the vectors allocated on one NUMA node
+struct NUMAReplica {
+    int node;
+    RNNDescent rnndescent;
+    std::vector<uint8_t> codes;  // empty if the storage is not flat
+};
+
 struct IndexRNNDescent : faiss::Index {
     bool own_fields;
     faiss::Index* storage;
     bool verbose;
 
+    /// normalize the vectors when they are added and the queries when
+    /// searching, so that METRIC_INNER_PRODUCT ranks by cosine similarity.
+    /// The other metrics are rejected.
+    bool cosine = false;
+
+    /// run the first T1 - 1 outer iterations of add() on a temporary SQ8
+    /// copy of the vectors, and only the last one on the storage
+    bool build_with_sq8_proxy = false;
+
+    /// interleave the pages of the vectors and of the graph over the NUMA
+    /// nodes, instead of leaving them on the node of the adding thread
+    bool numa_interleave = false;
+
+    /// back the vectors and the graph with transparent huge pages after
+    /// each build, to reduce the TLB misses of the search
+    bool huge_pages = false;
+
     RNNDescent rnndescent;
 
+    /// filled by replicate_for_numa, each search thread uses the replica of
+    /// its node
+    std::vector<NUMAReplica> numa_replicas;
+
+    /// results of the recent queries, searched before the graph if set (see
+    /// enable_query_cache). It is cleared when the vectors change, but not
+    /// when the search parameters of rnndescent do.
+    std::unique_ptr<QueryCache> query_cache;
+
     explicit IndexRNNDescent(int d = 0, int K = 32,
                              faiss::MetricType metric = faiss::METRIC_L2);
     explicit IndexRNNDescent(Index* storage, int K = 32);
@@ -21,15 +86,129 @@ struct IndexRNNDescent : faiss::Index {
 
     void add(idx_t n, const float* x) override;
 
+    /** Add the vectors and build the graph from an approximate KNN graph of
+     * the whole database (ntotal x k ids, e.g. the result of a previous
+     * build or of another KNN method).
+     */
+    void add_with_knn_graph(idx_t n, const float* x, const idx_t* knn_graph,
+                            int k);
+
     void train(idx_t n, const float* x) override;
 
+    /** Remove the vectors i with removed[i] set, the others are renumbered
+     * in the same order, and add the n vectors x. Unlike add, the graph is
+     * not rebuilt but repaired around the removed and the added vectors
+     * (see RNNDescent::update_graph).
+     */
+    void update_vectors(idx_t n, const float* x,
+                        const std::vector<bool>& removed);
+
     void search(idx_t n, const float* x, idx_t k, float* distances,
                 idx_t* labels,
                 const faiss::SearchParameters* params = nullptr) const override;
 
+    /// Graph-based range search (see RNNDescent::range_search). For inner
+    /// products, the results have a similarity larger than radius.
+    void range_search(idx_t n, const float* x, float radius,
+                      faiss::RangeSearchResult* result,
+                      const faiss::SearchParameters* params =
+                          nullptr) const override;
+
+    /// Search the graph, without the query cache
+    void search_graph(
+        idx_t n, const float* x, idx_t k, float* distances, idx_t* labels,
+        const SearchParametersRNNDescent* params = nullptr) const;
+
+    /// Take the results of the queries found in query_cache from it, and
+    /// search the others with search_graph and add them to it
+    void search_with_cache(
+        idx_t n, const float* x, idx_t k, float* distances, idx_t* labels,
+        const SearchParametersRNNDescent* params = nullptr) const;
+
+    /// Search the queries one after the other, each with a team of
+    /// rnndescent.search_team_size threads (see RNNDescent::search_parallel)
+    void search_with_teams(
+        idx_t n, const float* x, idx_t k, float* distances, idx_t* labels,
+        const SearchParametersRNNDescent* params = nullptr) const;
+
+    /// Search the queries by batches of rnndescent.search_batch_size (see
+    /// RNNDescent::search_batch), grouped by the entry point of the
+    /// navigation hierarchy. search does not use it: the distances to the
+    /// union of the candidates of a batch cost more than the per-query
+    /// search saves. Returns false if the graph has no hierarchy or the
+    /// storage is not flat, the queries are not searched then.
+    bool search_with_batches(
+        idx_t n, const float* x, idx_t k, float* distances, idx_t* labels,
+        const SearchParametersRNNDescent* params = nullptr) const;
+
+    /** Search a single query on the calling thread, without OpenMP nor
+     * interruption checks, for callers that have their own thread pool.
+     * The NUMA replicas and the search teams are not used.
+     */
+    void search_one(const float* x, idx_t k, float* distances, idx_t* labels,
+                    RNNDescentSearchContext& context,
+                    const SearchParametersRNNDescent* params = nullptr) const;
+
+    /// Search the queries with search_one, by tasks of a few queries run by
+    /// executor instead of OpenMP
+    void search_with_executor(
+        idx_t n, const float* x, idx_t k, float* distances, idx_t* labels,
+        const SearchExecutor& executor,
+        const SearchParametersRNNDescent* params = nullptr) const;
+
+    /** k nearest neighbors of every indexed vector (ntotal x k, the vector
+     * itself excluded, -1 for missing), found by searching the graph from
+     * each vector (see RNNDescent::compute_knn_graph). See
+     * write_knn_graph to save them.
+     */
+    void compute_knn_graph(
+        idx_t k, idx_t* labels, float* distances,
+        const SearchParametersRNNDescent* params = nullptr) const;
+
     void reconstruct(idx_t key, float* recons) const override;
 
     void reset() override;
+
+    /** Append the vectors of otherIndex (which is emptied) and connect the
+     * two graphs without rebuilding them. The ids of otherIndex are shifted
+     * by ntotal.
+     */
+    void merge_from(faiss::Index& otherIndex, idx_t add_id = 0) override;
+
+    void check_compatible_for_merge(
+        const faiss::Index& otherIndex) const override;
+
+    /** Copy the graph and the vectors of a flat storage to each NUMA node.
+     * This multiplies their memory by the number of nodes, but the search
+     * threads only read local memory. Adding or merging vectors drops the
+     * replicas.
+     */
+    void replicate_for_numa();
+
+    /// Cache the results of up to capacity queries, see QueryCache
+    void enable_query_cache(size_t capacity, float quantization_step = 0,
+                            int n_shards = 16);
+
+    /// Back the vectors of a flat storage and the graph (and its replicas)
+    /// with huge pages. Returns false if any of them could not be. Unlike
+    /// setting huge_pages, this does not apply to the later builds.
+    bool enable_huge_pages();
+};
+
+/** RNNDescent on vectors compressed by a ScalarQuantizer. The graph is built
+ * and searched on the codes: QT_fp16, QT_8bit (per-dimension range),
+ * QT_8bit_uniform and QT_8bit_direct have dedicated SIMD kernels, the
+ * other types decode the vectors. QT_8bit needs training.
+ */
+struct IndexRNNDescentSQ : IndexRNNDescent {
+    IndexRNNDescentSQ(int d, faiss::ScalarQuantizer::QuantizerType qtype,
+                      int K = 32, faiss::MetricType metric = faiss::METRIC_L2);
+};
+
+/// RNNDescent on vectors stored in bfloat16, see IndexFlatBF16
+struct IndexRNNDescentBF16 : IndexRNNDescent {
+    explicit IndexRNNDescentBF16(int d, int K = 32,
+                                 faiss::MetricType metric = faiss::METRIC_L2);
 };
 
 }  // namespace rnndescent
\ No newline at end of file
@@ -0,0 +1,142 @@
+#include <rnn-descent/QueryCache.h>
+
+#include <faiss/impl/FaissAssert.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace rnndescent {
+
+namespace {
+
+inline uint64_t mix(uint64_t h, uint64_t x) {
+    // splitmix64 finalizer of the combination
+    h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+inline uint32_t float_bits(float x) {
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+}  // namespace
+
+bool QueryCache::Key::operator==(const Key& other) const {
+    return hash == other.hash && k == other.k && search_L == other.search_L &&
+           patience == other.patience &&
+           float_bits(distance_ratio) == float_bits(other.distance_ratio) &&
+           codes == other.codes;
+}
+
+QueryCache::QueryCache(int d, size_t capacity, float quantization_step,
+                       int n_shards)
+    : d(d),
+      quantization_step(quantization_step),
+      shard_capacity(std::max<size_t>(
+          (capacity + std::max(n_shards, 1) - 1) / std::max(n_shards, 1),
+          1)),
+      n_shards(std::max(n_shards, 1)),
+      shards(new Shard[std::max(n_shards, 1)]) {
+    FAISS_THROW_IF_NOT(quantization_step >= 0);
+}
+
+QueryCache::Key QueryCache::make_key(
+    const float* x, idx_t k, int search_L,
+    const SearchParametersRNNDescent* params) const {
+    Key key;
+    key.codes.resize(d);
+    if (quantization_step > 0) {
+        const float lo = std::numeric_limits<int32_t>::min();
+        const float hi = std::numeric_limits<int32_t>::max();
+        for (int i = 0; i < d; i++) {
+            float q = std::round(x[i] / quantization_step);
+            key.codes[i] = (int32_t)std::min(std::max(q, lo), hi);
+        }
+    } else {
+        memcpy(key.codes.data(), x, sizeof(float) * d);
+    }
+    key.k = k;
+    key.search_L = search_L;
+    key.patience = params ? params->patience : 0;
+    key.distance_ratio = params ? params->distance_ratio : 0;
+
+    uint64_t h = mix(mix(k, search_L), key.patience);
+    h = mix(h, float_bits(key.distance_ratio));
+    for (int32_t c : key.codes) {
+        h = mix(h, (uint32_t)c);
+    }
+    key.hash = h;
+    return key;
+}
+
+QueryCache::Shard& QueryCache::shard_of(uint64_t hash) const {
+    // the low bits index the map of the shard
+    return shards[(hash >> 40) % n_shards];
+}
+
+bool QueryCache::lookup(const Key& key, float* distances, idx_t* labels) {
+    Shard& shard = shard_of(key.hash);
+    {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        auto it = shard.entries.find(key.hash);
+        if (it != shard.entries.end() && it->second->key == key) {
+            const Entry& entry = *it->second;
+            std::copy(entry.labels.begin(), entry.labels.end(), labels);
+            std::copy(entry.distances.begin(), entry.distances.end(),
+                      distances);
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            n_hits++;
+            return true;
+        }
+    }
+    n_misses++;
+    return false;
+}
+
+void QueryCache::insert(Key key, const float* distances,
+                        const idx_t* labels) {
+    const uint64_t hash = key.hash;
+    const idx_t k = key.k;
+    Shard& shard = shard_of(hash);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+
+    // a hash collision replaces the other query
+    auto it = shard.entries.find(hash);
+    if (it != shard.entries.end()) {
+        shard.lru.erase(it->second);
+        shard.entries.erase(it);
+    }
+    if (shard.lru.size() >= shard_capacity) {
+        shard.entries.erase(shard.lru.back().key.hash);
+        shard.lru.pop_back();
+    }
+    shard.lru.push_front({std::move(key),
+                          std::vector<idx_t>(labels, labels + k),
+                          std::vector<float>(distances, distances + k)});
+    shard.entries[hash] = shard.lru.begin();
+}
+
+void QueryCache::clear() {
+    for (int i = 0; i < n_shards; i++) {
+        std::lock_guard<std::mutex> guard(shards[i].mutex);
+        shards[i].lru.clear();
+        shards[i].entries.clear();
+    }
+}
+
+double QueryCache::hit_rate() const {
+    size_t hits = n_hits.load();
+    size_t lookups = hits + n_misses.load();
+    return lookups == 0 ? 0.0 : (double)hits / lookups;
+}
+
+}  // namespace rnndescent
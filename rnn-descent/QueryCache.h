@@ -0,0 +1,78 @@
+#pragma once
+
+#include <rnn-descent/RNNDescent.h>
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace rnndescent {
+
+using idx_t = faiss::idx_t;
+
+/** Bounded LRU cache of search results, split into shards that have their
+ * own lock so that concurrent searches rarely wait for each other. The key
+ * of a query is its vector rounded to a multiple of quantization_step (its
+ * exact value if the step is 0), with k and the search parameters. So the
+ * near-duplicate queries that round to the same vector share their result.
+ */
+struct QueryCache {
+    struct Key {
+        std::vector<int32_t> codes;  // the quantized query
+        idx_t k;
+        int search_L;
+        int patience;
+        float distance_ratio;
+        uint64_t hash;
+
+        bool operator==(const Key& other) const;
+    };
+
+    struct Entry {
+        Key key;
+        std::vector<idx_t> labels;
+        std::vector<float> distances;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;  // from the most recently used
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+    };
+
+    const int d;
+    const float quantization_step;
+    const size_t shard_capacity;  // entries per shard
+
+    std::atomic<size_t> n_hits{0};
+    std::atomic<size_t> n_misses{0};
+
+    int n_shards;
+    std::unique_ptr<Shard[]> shards;
+
+    /// capacity is the total number of results kept
+    QueryCache(int d, size_t capacity, float quantization_step = 0,
+               int n_shards = 16);
+
+    /// search_L is the pool size used by the search, params may be nullptr
+    Key make_key(const float* x, idx_t k, int search_L,
+                 const SearchParametersRNNDescent* params) const;
+
+    /// fills distances[k] and labels[k] and returns true on a hit
+    bool lookup(const Key& key, float* distances, idx_t* labels);
+
+    void insert(Key key, const float* distances, const idx_t* labels);
+
+    /// drop all the results, e.g. when the index changes
+    void clear();
+
+    double hit_rate() const;
+
+    Shard& shard_of(uint64_t hash) const;
+};
+
+}  // namespace rnndescent
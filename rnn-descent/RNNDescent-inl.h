@@ -0,0 +1,834 @@
+#pragma once
+
+/* Inner loops of RNNDescent, compiled once per SIMD level together with
+   distances-inl.h. The distance computers of DistanceComputer.h are
+   replaced by functors on their data, so that the distance calls are
+   inlined and use the instruction set of the level. */
+
+#include <faiss/impl/AuxIndexStructures.h>
+#include <faiss/impl/DistanceComputer.h>
+#include <rnn-descent/DistanceComputer.h>
+#include <rnn-descent/RNNDescent.h>
+#include <rnn-descent/distances-inl.h>
+#include <rnn-descent/simd_dispatch.h>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <type_traits>
+
+RNNDESCENT_TARGET_BEGIN
+
+namespace rnndescent {
+namespace RNNDESCENT_SIMD_NS {
+
+/**************************************************************
+ * Distance functors
+ **************************************************************/
+
+/// Distances on the data of a FlatDistanceComputer
+template <class Codec, faiss::MetricType metric, int D>
+struct FlatDistance {
+    using T = typename Codec::T;
+
+    const T* xb;
+    size_t d;
+    const float* q;
+    Codec codec;
+
+    explicit FlatDistance(const FlatDistanceComputer& dc)
+        : xb((const T*)dc.codes),
+          d(dc.d),
+          q(dc.q),
+          codec(dc.params.data(), dc.d) {}
+
+    static float sign(float dis) {
+        return metric == faiss::METRIC_L2 ? dis : -dis;
+    }
+
+    float operator()(faiss::idx_t i) const {
+        return sign(
+            distance<metric, D>(CodecFloat(), q, codec, xb + i * d, d));
+    }
+
+    void distances_batch_4(faiss::idx_t i0, faiss::idx_t i1, faiss::idx_t i2,
+                           faiss::idx_t i3, float& dis0, float& dis1,
+                           float& dis2, float& dis3) const {
+        distance_batch_4<metric, D>(q, codec, xb + i0 * d, xb + i1 * d,
+                                    xb + i2 * d, xb + i3 * d, d, dis0, dis1,
+                                    dis2, dis3);
+        dis0 = sign(dis0);
+        dis1 = sign(dis1);
+        dis2 = sign(dis2);
+        dis3 = sign(dis3);
+    }
+
+    float symmetric_dis(faiss::idx_t i, faiss::idx_t j) const {
+        return sign(
+            distance<metric, D>(codec, xb + i * d, codec, xb + j * d, d));
+    }
+
+    float symmetric_dis_bounded(faiss::idx_t i, faiss::idx_t j,
+                                float bound) const {
+        if (metric != faiss::METRIC_L2) {
+            return symmetric_dis(i, j);
+        }
+        return l2sqr_bounded<D>(codec, xb + i * d, codec, xb + j * d, d,
+                                bound);
+    }
+};
+
+/// Virtual calls to any other distance computer
+struct GenericDistance {
+    faiss::DistanceComputer& dc;
+    BoundedDistanceComputer* bdis;
+
+    explicit GenericDistance(faiss::DistanceComputer& dc)
+        : dc(dc), bdis(dynamic_cast<BoundedDistanceComputer*>(&dc)) {}
+
+    float operator()(faiss::idx_t i) { return dc(i); }
+
+    void distances_batch_4(faiss::idx_t i0, faiss::idx_t i1, faiss::idx_t i2,
+                           faiss::idx_t i3, float& dis0, float& dis1,
+                           float& dis2, float& dis3) {
+        dc.distances_batch_4(i0, i1, i2, i3, dis0, dis1, dis2, dis3);
+    }
+
+    float symmetric_dis(faiss::idx_t i, faiss::idx_t j) {
+        return dc.symmetric_dis(i, j);
+    }
+
+    float symmetric_dis_bounded(faiss::idx_t i, faiss::idx_t j, float bound) {
+        return bdis ? bdis->symmetric_dis_bounded(i, j, bound)
+                    : dc.symmetric_dis(i, j);
+    }
+};
+
+template <class Codec, faiss::MetricType metric, class F>
+void dispatch_dimension(const FlatDistanceComputer& dc, F&& f) {
+    switch (dc.d) {
+#define DISPATCH_D(D)                                \
+    case D: {                                        \
+        FlatDistance<Codec, metric, D> dis(dc);      \
+        f(dis);                                      \
+        return;                                      \
+    }
+        DISPATCH_D(96)
+        DISPATCH_D(128)
+        DISPATCH_D(384)
+        DISPATCH_D(768)
+        DISPATCH_D(1024)
+#undef DISPATCH_D
+        default: {
+            FlatDistance<Codec, metric, 0> dis(dc);
+            f(dis);
+        }
+    }
+}
+
+template <class Codec, class F>
+void dispatch_metric(const FlatDistanceComputer& dc, F&& f) {
+    if (dc.metric == faiss::METRIC_L2) {
+        dispatch_dimension<Codec, faiss::METRIC_L2>(dc, f);
+    } else {
+        dispatch_dimension<Codec, faiss::METRIC_INNER_PRODUCT>(dc, f);
+    }
+}
+
+/** Calls f(dis), where dis is a FlatDistance functor specialized for qdis
+ * when it is a FlatDistanceComputer, and a GenericDistance otherwise.
+ */
+template <class F>
+void dispatch_distance(faiss::DistanceComputer& qdis, F&& f) {
+    auto dc = dynamic_cast<FlatDistanceComputer*>(&qdis);
+    if (!dc) {
+        GenericDistance dis(qdis);
+        f(dis);
+        return;
+    }
+    switch (dc->codec) {
+        case FlatCodec::FP16:
+            dispatch_metric<CodecFP16>(*dc, f);
+            break;
+        case FlatCodec::BF16:
+            dispatch_metric<CodecBF16>(*dc, f);
+            break;
+        case FlatCodec::UInt8:
+            dispatch_metric<CodecUInt8>(*dc, f);
+            break;
+        case FlatCodec::SQ8:
+            dispatch_metric<CodecSQ8>(*dc, f);
+            break;
+        default:
+            dispatch_metric<CodecFloat>(*dc, f);
+    }
+}
+
+/**************************************************************
+ * Graph construction
+ **************************************************************/
+
+// nn is pruned by a neighbor closer to it than this bound, for the
+// distance dis from u to nn
+inline float prune_bound(float dis, float alpha) {
+    return dis >= 0 ? dis / alpha : dis * alpha;
+}
+
+template <class Distance>
+void update_neighbors_impl(RNNDescent& rnndescent, Distance& qdis,
+                           float alpha) {
+    auto& graph = rnndescent.graph;
+    auto& dis_caches = rnndescent.dis_caches;
+    const int ntotal = rnndescent.ntotal;
+
+    // the caches follow the changes of the number of threads and of
+    // dis_cache_size
+    const size_t nt = omp_get_max_threads();
+    const size_t cache_size = rnndescent.dis_cache_size / nt;
+    const size_t capacity = DistanceCache::capacity_for(cache_size);
+    if (rnndescent.dis_cache_size == 0) {
+        std::vector<DistanceCache>().swap(dis_caches);
+    } else if (dis_caches.size() != nt ||
+               dis_caches[0].keys.size() != capacity) {
+        dis_caches.assign(nt, DistanceCache(cache_size));
+    }
+
+    size_t n_dis = 0, n_cache_hits = 0;
+
+    auto update = [&](int u, DistanceCache* cache, size_t& ndis,
+                      size_t& nhits) {
+        auto& nhood = graph[u];
+        auto& pool = nhood.pool;
+        std::vector<faiss::nndescent::Neighbor> new_pool;
+        std::vector<faiss::nndescent::Neighbor> old_pool;
+        {
+            std::lock_guard<std::mutex> guard(nhood.lock);
+            // nothing to prune if all the edges are old
+            if (std::none_of(pool.begin(), pool.end(),
+                             [](faiss::nndescent::Neighbor& nn) {
+                                 return nn.flag;
+                             })) {
+                return;
+            }
+            old_pool = pool;
+            pool.clear();
+        }
+        std::sort(old_pool.begin(), old_pool.end());
+        old_pool.erase(std::unique(old_pool.begin(), old_pool.end(),
+                                   [](faiss::nndescent::Neighbor& a,
+                                      faiss::nndescent::Neighbor& b) {
+                                       return a.id == b.id;
+                                   }),
+                       old_pool.end());
+
+        for (auto&& nn : old_pool) {
+            const float bound =
+                alpha == 1 ? nn.distance : prune_bound(nn.distance, alpha);
+            bool ok = true;
+            for (auto&& other_nn : new_pool) {
+                if (!nn.flag && !other_nn.flag) {
+                    continue;
+                }
+                if (nn.id == other_nn.id) {
+                    ok = false;
+                    break;
+                }
+                // only the distances smaller than the bound matter, so a
+                // lower bound that exceeds it is enough
+                float distance;
+                bool exact;
+                if (cache && cache->get(nn.id, other_nn.id, distance, exact) &&
+                    (exact || distance >= bound)) {
+                    ++nhits;
+                } else {
+                    distance = qdis.symmetric_dis_bounded(nn.id, other_nn.id,
+                                                          bound);
+                    ++ndis;
+                    if (cache) {
+                        cache->set(nn.id, other_nn.id, distance,
+                                   distance < bound);
+                    }
+                }
+                if (distance < bound) {
+                    ok = false;
+                    rnndescent.insert_nn(other_nn.id, nn.id, distance, true);
+                    break;
+                }
+            }
+            if (ok) {
+                new_pool.emplace_back(nn);
+            }
+        }
+
+        for (auto&& nn : new_pool) {
+            nn.flag = false;
+        }
+        {
+            std::lock_guard<std::mutex> guard(nhood.lock);
+            pool.insert(pool.end(), new_pool.begin(), new_pool.end());
+        }
+    };
+
+    if (dis_caches.empty()) {
+#pragma omp parallel for schedule(dynamic, 256) reduction(+ : n_dis)
+        for (int u = 0; u < ntotal; ++u) {
+            update(u, nullptr, n_dis, n_cache_hits);
+        }
+    } else {
+        // a static schedule gives the same vertices to the same thread at
+        // every call, so that the pairs of their pools hit the cache
+#pragma omp parallel for schedule(static, 256) reduction(+ : n_dis, n_cache_hits)
+        for (int u = 0; u < ntotal; ++u) {
+            update(u, &dis_caches[omp_get_thread_num()], n_dis, n_cache_hits);
+        }
+    }
+
+    rnndescent_stats.n_dis += n_dis;
+    rnndescent_stats.n_cache_hits += n_cache_hits;
+}
+
+void update_neighbors(RNNDescent& rnndescent, faiss::DistanceComputer& qdis,
+                      float alpha) {
+    dispatch_distance(qdis, [&](auto& dis) {
+        update_neighbors_impl(rnndescent, dis, alpha);
+    });
+}
+
+/**************************************************************
+ * Search
+ **************************************************************/
+
+// Insert a new point into the candidate pool in ascending order
+inline int insert_into_pool(faiss::nndescent::Neighbor* addr, int size,
+                            faiss::nndescent::Neighbor nn) {
+    // find the location to insert
+    int left = 0, right = size - 1;
+    if (addr[left].distance > nn.distance) {
+        memmove((char*)&addr[left + 1], &addr[left],
+                size * sizeof(faiss::nndescent::Neighbor));
+        addr[left] = nn;
+        return left;
+    }
+    if (addr[right].distance < nn.distance) {
+        addr[size] = nn;
+        return size;
+    }
+    while (left < right - 1) {
+        int mid = (left + right) / 2;
+        if (addr[mid].distance > nn.distance)
+            right = mid;
+        else
+            left = mid;
+    }
+    // check equal ID
+
+    while (left > 0) {
+        if (addr[left].distance < nn.distance) break;
+        if (addr[left].id == nn.id) return size + 1;
+        left--;
+    }
+    if (addr[left].id == nn.id || addr[right].id == nn.id) return size + 1;
+    memmove((char*)&addr[right + 1], &addr[right],
+            (size - right) * sizeof(faiss::nndescent::Neighbor));
+    addr[right] = nn;
+    return right;
+}
+
+// Slot of the candidate pool not filled yet
+inline faiss::nndescent::Neighbor empty_slot() {
+    return faiss::nndescent::Neighbor(-1, std::numeric_limits<float>::max(),
+                                      false);
+}
+
+// The candidates above this distance are not expanded, for the distance
+// dk of the k-th result. |dk| is used for the negated inner products.
+inline float distance_ratio_bound(float dk, float distance_ratio) {
+    return dk + (distance_ratio - 1) * std::fabs(dk);
+}
+
+template <class Distance>
+void search_in_range_impl(const RNNDescent& rnndescent, Distance& qdis,
+                          const int begin, const int end, const int topk,
+                          int L, faiss::idx_t* indices, float* dists,
+                          faiss::VisitedTable& vt,
+                          const SearchParametersRNNDescent* params,
+                          int entry, const float radius,
+                          std::vector<faiss::nndescent::Neighbor>* in_radius) {
+    const auto& final_graph = rnndescent.final_graph;
+    const auto& offsets = rnndescent.offsets;
+    const int n_range = end - begin;
+    L = std::min(L, n_range);
+
+    // every computed distance goes through visit
+    auto visit = [&](int id, float dist) {
+        if (in_radius && dist < radius) {
+            in_radius->emplace_back(id, dist, true);
+        }
+        return dist;
+    };
+
+    // candidate pool, the K best items is the result.
+    std::vector<faiss::nndescent::Neighbor> retset(L + 1);
+
+    if (entry >= 0) {
+        // the pool starts from the entry point, the other slots are empty
+        vt.set(entry);
+        retset[0] = faiss::nndescent::Neighbor(entry,
+                                               visit(entry, qdis(entry)), true);
+        for (int i = 1; i < L; i++) {
+            retset[i] = empty_slot();
+        }
+    } else {
+        // Randomly choose L points to initialize the candidate pool
+        std::vector<int> init_ids(L);
+        std::mt19937 rng(rnndescent.random_seed);
+
+        if (L < n_range) {
+            gen_random(rng, init_ids.data(), L, n_range);
+        } else {
+            std::iota(init_ids.begin(), init_ids.end(), 0);
+        }
+        for (int i = 0; i < L; i++) {
+            int id = begin + init_ids[i];
+            vt.set(id);
+            float dist = visit(id, qdis(id));
+            retset[i] = faiss::nndescent::Neighbor(id, dist, true);
+        }
+
+        // Maintain the candidate pool in ascending order
+        std::sort(retset.begin(), retset.begin() + L);
+    }
+
+    const int patience = params ? params->patience : 0;
+    const float distance_ratio = params ? params->distance_ratio : 0;
+    const int kth = std::min(topk, L) - 1;
+    int n_stale = 0;  // consecutive expansions that left the top-k unchanged
+
+    int k = 0;
+
+    // Stop until the smallest position updated is >= L
+    while (k < L) {
+        int nk = L;
+
+        auto add_candidate = [&](int id, float dist) {
+            visit(id, dist);
+            if (dist >= retset[L - 1].distance) return;
+
+            faiss::nndescent::Neighbor nn(id, dist, true);
+            int r = insert_into_pool(retset.data(), L, nn);
+
+            if (r < nk) nk = r;
+        };
+
+        if (retset[k].flag) {
+            // the pool is sorted, so no candidate is left below the bound
+            if (distance_ratio > 0 && kth >= 0 &&
+                retset[k].distance > distance_ratio_bound(
+                                         retset[kth].distance, distance_ratio)) {
+                break;
+            }
+            retset[k].flag = false;
+            int n = retset[k].id;
+
+            int offset = offsets[n];
+            int K = std::min(rnndescent.K0, offsets[n + 1] - offset);
+
+            // the distances are computed by batches of 4 unvisited
+            // neighbors, which shares the loads of the query
+            int batch[4];
+            int n_batch = 0;
+            for (int m = 0; m < K; ++m) {
+                int id = final_graph[offset + m];
+                if (vt.get(id)) continue;
+
+                vt.set(id);
+                batch[n_batch++] = id;
+                if (n_batch == 4) {
+                    float dis[4];
+                    qdis.distances_batch_4(batch[0], batch[1], batch[2],
+                                           batch[3], dis[0], dis[1], dis[2],
+                                           dis[3]);
+                    for (int j = 0; j < 4; j++) {
+                        add_candidate(batch[j], dis[j]);
+                    }
+                    n_batch = 0;
+                }
+            }
+            for (int j = 0; j < n_batch; j++) {
+                add_candidate(batch[j], qdis(batch[j]));
+            }
+
+            if (patience > 0) {
+                n_stale = nk < topk ? 0 : n_stale + 1;
+                if (n_stale >= patience) break;
+            }
+        }
+        if (nk <= k)
+            k = nk;
+        else
+            ++k;
+    }
+    for (size_t i = 0; i < topk; i++) {
+        if (i < L && retset[i].id >= 0) {
+            indices[i] = retset[i].id;
+            dists[i] = retset[i].distance;
+        } else {
+            indices[i] = -1;
+            dists[i] = std::numeric_limits<float>::max();
+        }
+    }
+
+    // the range search goes on from the vertices visited
+    if (!in_radius) {
+        vt.advance();
+    }
+}
+
+void search_in_range(const RNNDescent& rnndescent,
+                     faiss::DistanceComputer& qdis, const int begin,
+                     const int end, const int topk, int L,
+                     faiss::idx_t* indices, float* dists,
+                     faiss::VisitedTable& vt,
+                     const SearchParametersRNNDescent* params, int entry,
+                     const float radius,
+                     std::vector<faiss::nndescent::Neighbor>* in_radius) {
+    dispatch_distance(qdis, [&](auto& dis) {
+        search_in_range_impl(rnndescent, dis, begin, end, topk, L, indices,
+                             dists, vt, params, entry, radius, in_radius);
+    });
+}
+
+/// distances from the query of dc to the n vertices ids
+using TeamDistances = void (*)(faiss::DistanceComputer& dc, const int* ids,
+                               const int n, float* dis);
+
+template <class Distance>
+void team_distances(faiss::DistanceComputer& dc, const int* ids, const int n,
+                    float* dis) {
+    auto compute = [&](Distance& qdis) {
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+            qdis.distances_batch_4(ids[i], ids[i + 1], ids[i + 2],
+                                   ids[i + 3], dis[i], dis[i + 1],
+                                   dis[i + 2], dis[i + 3]);
+        }
+        for (; i < n; i++) {
+            dis[i] = qdis(ids[i]);
+        }
+    };
+    if constexpr (std::is_same<Distance, GenericDistance>::value) {
+        GenericDistance qdis(dc);
+        compute(qdis);
+    } else {
+        Distance qdis(static_cast<FlatDistanceComputer&>(dc));
+        compute(qdis);
+    }
+}
+
+/* The threads of the team share the pool and the visited table. At each
+   round, the n_threads best unexpanded candidates are expanded in parallel,
+   one per thread, and their neighbors are merged into the pool. The
+   distance computers of the team are of the same type, so the distance
+   functor is selected once, before the parallel region. */
+void search_parallel(const RNNDescent& rnndescent,
+                     faiss::DistanceComputer** team_dis, const int n_threads,
+                     const int topk, int L, faiss::idx_t* indices,
+                     float* dists, faiss::VisitedTable& vt,
+                     const SearchParametersRNNDescent* params, int entry) {
+    const auto& final_graph = rnndescent.final_graph;
+    const auto& offsets = rnndescent.offsets;
+    const int ntotal = rnndescent.ntotal;
+    L = std::min(L, ntotal);
+
+    TeamDistances distances = nullptr;
+    dispatch_distance(*team_dis[0], [&](auto& dis) {
+        distances = &team_distances<std::decay_t<decltype(dis)>>;
+    });
+
+    std::vector<faiss::nndescent::Neighbor> retset(L + 1);
+
+    // the pool starts from the entry point or from L random vertices
+    const int n_init = entry >= 0 ? 1 : L;
+    std::vector<int> init_ids(n_init);
+    if (entry >= 0) {
+        init_ids[0] = entry;
+        vt.set(entry);
+    } else if (L < ntotal) {
+        std::mt19937 rng(rnndescent.random_seed);
+        gen_random(rng, init_ids.data(), L, ntotal);
+    } else {
+        std::iota(init_ids.begin(), init_ids.end(), 0);
+    }
+
+    const int patience = params ? params->patience : 0;
+    const float distance_ratio = params ? params->distance_ratio : 0;
+    const int kth = std::min(topk, L) - 1;
+    int n_stale = 0;  // consecutive expansions that left the top-k unchanged
+    int best_pos = 0;  // best position of the neighbors found in a round
+
+    std::vector<int> expand;
+    expand.reserve(n_threads);
+    float bound = 0;
+
+#pragma omp parallel num_threads(n_threads)
+    {
+        const int t = omp_get_thread_num();
+        // the team may be smaller than n_threads (nested region, thread
+        // limit), a round expands one candidate per thread of the team
+        const int team_size = omp_get_num_threads();
+        faiss::DistanceComputer& qdis = *team_dis[t];
+
+#pragma omp for
+        for (int i = 0; i < n_init; i++) {
+            float dis;
+            distances(qdis, &init_ids[i], 1, &dis);
+            retset[i] = faiss::nndescent::Neighbor(init_ids[i], dis, true);
+        }
+
+#pragma omp single
+        {
+            std::sort(retset.begin(), retset.begin() + n_init);
+            for (int i = n_init; i < L; i++) {
+                retset[i] = empty_slot();
+            }
+        }
+
+        std::vector<int> ids;
+        std::vector<float> dis;
+        std::vector<faiss::nndescent::Neighbor> found;
+        while (true) {
+#pragma omp single
+            {
+                if (!expand.empty() && patience > 0) {
+                    n_stale = best_pos < topk ? 0 : n_stale + expand.size();
+                }
+                expand.clear();
+                float ratio_bound =
+                    distance_ratio > 0 && kth >= 0
+                        ? distance_ratio_bound(retset[kth].distance,
+                                               distance_ratio)
+                        : std::numeric_limits<float>::infinity();
+                for (int k = 0; k < L && expand.size() < team_size; k++) {
+                    if (retset[k].distance > ratio_bound) break;
+                    if (retset[k].flag) {
+                        retset[k].flag = false;
+                        expand.push_back(retset[k].id);
+                    }
+                }
+                if (patience > 0 && n_stale >= patience) {
+                    expand.clear();
+                }
+                bound = retset[L - 1].distance;
+                best_pos = L;
+            }
+            if (expand.empty()) {
+                break;
+            }
+
+            found.clear();
+            if (t < expand.size()) {
+                int n = expand[t];
+                int offset = offsets[n];
+                int K = std::min(rnndescent.K0, offsets[n + 1] - offset);
+                ids.clear();
+                for (int m = 0; m < K; ++m) {
+                    int id = final_graph[offset + m];
+                    // the first thread to set the entry computes the
+                    // distance
+                    if (__atomic_exchange_n(&vt.visited[id], vt.visno,
+                                            __ATOMIC_RELAXED) != vt.visno) {
+                        ids.push_back(id);
+                    }
+                }
+                dis.resize(ids.size());
+                distances(qdis, ids.data(), ids.size(), dis.data());
+                for (size_t j = 0; j < ids.size(); j++) {
+                    if (dis[j] < bound) {
+                        found.emplace_back(ids[j], dis[j], true);
+                    }
+                }
+            }
+
+#pragma omp critical
+            for (auto& nn : found) {
+                if (nn.distance < retset[L - 1].distance) {
+                    int r = insert_into_pool(retset.data(), L, nn);
+                    best_pos = std::min(best_pos, r);
+                }
+            }
+#pragma omp barrier
+        }
+    }
+
+    for (size_t i = 0; i < topk; i++) {
+        if (i < L && retset[i].id >= 0) {
+            indices[i] = retset[i].id;
+            dists[i] = retset[i].distance;
+        } else {
+            indices[i] = -1;
+            dists[i] = std::numeric_limits<float>::max();
+        }
+    }
+
+    vt.advance();
+}
+
+/* The queries of the batch share the visited table: the distances to a
+   candidate are computed for all the queries at the same time. */
+void search_batch(const RNNDescent& rnndescent, FlatDistanceComputer& dis,
+                  const int nq, const float* xq, const int topk, int L,
+                  faiss::idx_t* indices, float* dists, faiss::VisitedTable& vt,
+                  const SearchParametersRNNDescent* params) {
+    const auto& final_graph = rnndescent.final_graph;
+    const auto& offsets = rnndescent.offsets;
+    const int ntotal = rnndescent.ntotal;
+    const size_t d = dis.d;
+    L = std::min(L, ntotal);
+
+    const int patience = params ? params->patience : 0;
+    const float distance_ratio = params ? params->distance_ratio : 0;
+    const int kth = std::min(topk, L) - 1;
+
+    const FlatKernels& kernels =
+        RNNDESCENT_SIMD_NS::get_flat_kernels(dis.codec, dis.metric);
+
+    // candidates of the round, and their distances to the queries
+    std::vector<int> cand;
+    std::vector<float> cand_dis;
+    auto compute_distances = [&]() {
+        cand_dis.resize(cand.size() * nq);
+        for (size_t c = 0; c < cand.size(); c++) {
+            kernels.queries_dis(xq, nq, dis.codes + cand[c] * dis.code_size,
+                                d, dis.params.data(),
+                                cand_dis.data() + c * nq);
+        }
+    };
+
+    // the pools start from the entry points of all the queries, or from L
+    // random vertices
+    if (!rnndescent.levels.empty()) {
+        for (int q = 0; q < nq; q++) {
+            dis.set_query(xq + q * d);
+            int entry = rnndescent.entry_point(dis);
+            if (!vt.get(entry)) {
+                vt.set(entry);
+                cand.push_back(entry);
+            }
+        }
+    } else {
+        cand.resize(L);
+        if (L < ntotal) {
+            std::mt19937 rng(rnndescent.random_seed);
+            gen_random(rng, cand.data(), L, ntotal);
+        } else {
+            std::iota(cand.begin(), cand.end(), 0);
+        }
+        for (int id : cand) {
+            vt.set(id);
+        }
+    }
+    compute_distances();
+
+    struct Query {
+        std::vector<faiss::nndescent::Neighbor> retset;
+        int k = 0;        // no unexpanded candidate before k
+        int n_stale = 0;  // consecutive expansions without a new top-k
+        bool done = false;
+    };
+    std::vector<Query> queries(nq);
+    for (int q = 0; q < nq; q++) {
+        auto& retset = queries[q].retset;
+        for (size_t c = 0; c < cand.size(); c++) {
+            retset.emplace_back(cand[c], cand_dis[c * nq + q], true);
+        }
+        std::sort(retset.begin(), retset.end());
+        retset.resize(L + 1, empty_slot());
+    }
+
+    std::vector<bool> expanded(nq);
+    while (true) {
+        cand.clear();
+        bool any_expanded = false;
+        for (int q = 0; q < nq; q++) {
+            auto& query = queries[q];
+            auto& retset = query.retset;
+            expanded[q] = false;
+            if (query.done) continue;
+
+            while (query.k < L && !retset[query.k].flag) {
+                query.k++;
+            }
+            if (query.k == L ||
+                (distance_ratio > 0 && kth >= 0 &&
+                 retset[query.k].distance >
+                         distance_ratio_bound(retset[kth].distance,
+                                              distance_ratio))) {
+                query.done = true;
+                continue;
+            }
+
+            retset[query.k].flag = false;
+            int n = retset[query.k].id;
+            int offset = offsets[n];
+            int K = std::min(rnndescent.K0, offsets[n + 1] - offset);
+            for (int m = 0; m < K; ++m) {
+                int id = final_graph[offset + m];
+                if (vt.get(id)) continue;
+                vt.set(id);
+                cand.push_back(id);
+            }
+            expanded[q] = any_expanded = true;
+        }
+        if (!any_expanded) {
+            break;
+        }
+
+        compute_distances();
+
+        for (int q = 0; q < nq; q++) {
+            auto& query = queries[q];
+            auto& retset = query.retset;
+            int nk = L;
+            for (size_t c = 0; c < cand.size(); c++) {
+                float dist = cand_dis[c * nq + q];
+                if (dist >= retset[L - 1].distance) continue;
+                faiss::nndescent::Neighbor nn(cand[c], dist, true);
+                nk = std::min(nk, insert_into_pool(retset.data(), L, nn));
+            }
+            query.k = std::min(query.k, nk);
+
+            if (expanded[q] && patience > 0) {
+                query.n_stale = nk < topk ? 0 : query.n_stale + 1;
+                if (query.n_stale >= patience) {
+                    query.done = true;
+                }
+            }
+        }
+    }
+
+    for (int q = 0; q < nq; q++) {
+        const auto& retset = queries[q].retset;
+        for (size_t i = 0; i < topk; i++) {
+            if (i < L && retset[i].id >= 0) {
+                indices[q * topk + i] = retset[i].id;
+                dists[q * topk + i] = retset[i].distance;
+            } else {
+                indices[q * topk + i] = -1;
+                dists[q * topk + i] = std::numeric_limits<float>::max();
+            }
+        }
+    }
+
+    vt.advance();
+}
+
+}  // namespace RNNDESCENT_SIMD_NS
+}  // namespace rnndescent
+
+RNNDESCENT_TARGET_END
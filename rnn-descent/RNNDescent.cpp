@@ -1,8 +1,20 @@
+#include <faiss/Clustering.h>
+#include <faiss/IndexFlat.h>
 #include <faiss/impl/AuxIndexStructures.h>
 #include <faiss/impl/DistanceComputer.h>
+#include <rnn-descent/DistanceComputer.h>
 #include <rnn-descent/RNNDescent.h>
+#include <rnn-descent/build_checkpoint.h>
+#include <rnn-descent/simd_dispatch.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <numeric>
 
 namespace rnndescent {
 
@@ -22,42 +34,97 @@ void gen_random(std::mt19937& rng, int* addr, const int size, const int N) {
     }
 }
 
-// Insert a new point into the candidate pool in ascending order
-int insert_into_pool(faiss::nndescent::Neighbor* addr, int size,
-                     faiss::nndescent::Neighbor nn) {
-    // find the location to insert
-    int left = 0, right = size - 1;
-    if (addr[left].distance > nn.distance) {
-        memmove((char*)&addr[left + 1], &addr[left],
-                size * sizeof(faiss::nndescent::Neighbor));
-        addr[left] = nn;
-        return left;
-    }
-    if (addr[right].distance < nn.distance) {
-        addr[size] = nn;
-        return size;
-    }
-    while (left < right - 1) {
-        int mid = (left + right) / 2;
-        if (addr[mid].distance > nn.distance)
-            right = mid;
-        else
-            left = mid;
-    }
-    // check equal ID
-
-    while (left > 0) {
-        if (addr[left].distance < nn.distance) break;
-        if (addr[left].id == nn.id) return size + 1;
-        left--;
-    }
-    if (addr[left].id == nn.id || addr[right].id == nn.id) return size + 1;
-    memmove((char*)&addr[right + 1], &addr[right],
-            (size - right) * sizeof(faiss::nndescent::Neighbor));
-    addr[right] = nn;
-    return right;
+RNNDescentStats rnndescent_stats;
+
+void RNNDescentStats::reset() {
+    n_dis = 0;
+    n_cache_hits = 0;
+}
+
+double RNNDescentStats::cache_hit_rate() const {
+    size_t hits = n_cache_hits;
+    size_t n_lookups = n_dis + hits;
+    return n_lookups == 0 ? 0.0 : (double)hits / n_lookups;
 }
 
+size_t DistanceCache::capacity_for(size_t size) {
+    size_t capacity = 1;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+DistanceCache::DistanceCache(size_t size) {
+    size_t capacity = capacity_for(size);
+    mask = capacity - 1;
+    keys.assign(capacity, ~uint64_t(0));
+    values.resize(capacity);
+}
+
+namespace {
+
+/* Distance computer whose query is a vector of the database. This is used
+   to search a graph with the vectors of another one. */
+struct StoredQueryDistanceComputer : faiss::DistanceComputer {
+    faiss::DistanceComputer& basedis;
+    faiss::idx_t q = 0;
+
+    explicit StoredQueryDistanceComputer(faiss::DistanceComputer& basedis)
+        : basedis(basedis) {}
+
+    void set_query(const float* x) override {
+        FAISS_THROW_MSG("the query is a stored vector");
+    }
+
+    float operator()(faiss::idx_t i) override {
+        return basedis.symmetric_dis(q, i);
+    }
+
+    float symmetric_dis(faiss::idx_t i, faiss::idx_t j) override {
+        return basedis.symmetric_dis(i, j);
+    }
+};
+
+/* Distances between the vertices of an upper level, numbered by their
+   position in ids. */
+struct SubsetDistanceComputer : BoundedDistanceComputer {
+    faiss::DistanceComputer& basedis;
+    BoundedDistanceComputer* bdis;
+    const int* ids;
+
+    SubsetDistanceComputer(faiss::DistanceComputer& basedis, const int* ids)
+        : basedis(basedis),
+          bdis(dynamic_cast<BoundedDistanceComputer*>(&basedis)),
+          ids(ids) {}
+
+    void set_query(const float* x) override { basedis.set_query(x); }
+
+    float operator()(faiss::idx_t i) override { return basedis(ids[i]); }
+
+    float symmetric_dis(faiss::idx_t i, faiss::idx_t j) override {
+        return basedis.symmetric_dis(ids[i], ids[j]);
+    }
+
+    float symmetric_dis_bounded(faiss::idx_t i, faiss::idx_t j,
+                                float bound) override {
+        return bdis ? bdis->symmetric_dis_bounded(ids[i], ids[j], bound)
+                    : basedis.symmetric_dis(ids[i], ids[j]);
+    }
+};
+
+/* The searches run concurrently, the level is only written when it
+   changes */
+void record_simd_level() {
+    SIMDLevel level = simd_level();
+    if (rnndescent_stats.simd_level.load(std::memory_order_relaxed) !=
+        level) {
+        rnndescent_stats.simd_level = level;
+    }
+}
+
+}  // namespace
+
 RNNDescent::RNNDescent(const int d) : d(d) {}
 
 RNNDescent::~RNNDescent() {}
@@ -94,66 +161,176 @@ void RNNDescent::init_graph(faiss::DistanceComputer& qdis) {
     }
 }
 
-void RNNDescent::insert_nn(int id, int nn_id, float distance, bool flag) {
-    auto& nhood = graph[id];
+void RNNDescent::init_graph_clustering(faiss::DistanceComputer& qdis,
+                                       const float* x, bool verbose) {
+    FAISS_THROW_IF_NOT_MSG(x, "clustering init requires the vectors");
+    int nlist = init_nlist > 0 ? init_nlist
+                               : std::max(1, (int)std::sqrt((double)ntotal));
+    nlist = std::min(nlist, ntotal);
+    int nprobe = std::max(1, std::min(init_nprobe, nlist));
+
+    // a coarse clustering is enough, the iterations refine the rest
+    faiss::IndexFlat quantizer(d, metric_type);
+    faiss::Clustering clus(d, nlist);
+    clus.niter = 10;
+    clus.seed = random_seed;
+    clus.max_points_per_centroid = 64;
+    clus.verbose = verbose;
+    clus.train(ntotal, x, quantizer);
+
+    std::vector<std::vector<int>> lists(nlist);
     {
-        std::lock_guard<std::mutex> guard(nhood.lock);
-        nhood.pool.emplace_back(nn_id, distance, flag);
+        std::vector<faiss::idx_t> assign(ntotal);
+        std::vector<float> dis(ntotal);
+        quantizer.search(ntotal, x, 1, dis.data(), assign.data());
+        for (int i = 0; i < ntotal; i++) {
+            lists[assign[i]].push_back(i);
+        }
     }
-}
 
-void RNNDescent::update_neighbors(faiss::DistanceComputer& qdis) {
-#pragma omp parallel for schedule(dynamic, 256)
-    for (int u = 0; u < ntotal; ++u) {
-        auto& nhood = graph[u];
-        auto& pool = nhood.pool;
-        std::vector<faiss::nndescent::Neighbor> new_pool;
-        std::vector<faiss::nndescent::Neighbor> old_pool;
-        {
-            std::lock_guard<std::mutex> guard(nhood.lock);
-            old_pool = pool;
-            pool.clear();
-        }
-        std::sort(old_pool.begin(), old_pool.end());
-        old_pool.erase(std::unique(old_pool.begin(), old_pool.end(),
-                                   [](faiss::nndescent::Neighbor& a,
-                                      faiss::nndescent::Neighbor& b) {
-                                       return a.id == b.id;
-                                   }),
-                       old_pool.end());
-
-        for (auto&& nn : old_pool) {
-            bool ok = true;
-            for (auto&& other_nn : new_pool) {
-                if (!nn.flag && !other_nn.flag) {
-                    continue;
-                }
-                if (nn.id == other_nn.id) {
-                    ok = false;
-                    break;
-                }
-                float distance = qdis.symmetric_dis(nn.id, other_nn.id);
-                if (distance < nn.distance) {
-                    ok = false;
-                    insert_nn(other_nn.id, nn.id, distance, true);
-                    break;
-                }
+    // the points of a cluster draw their candidates from its members and
+    // those of the nprobe - 1 clusters nearest to it
+    std::vector<faiss::idx_t> probes((size_t)nlist * nprobe);
+    {
+        std::vector<float> dis(probes.size());
+        quantizer.search(nlist, clus.centroids.data(), nprobe, dis.data(),
+                         probes.data());
+    }
+
+    graph.reserve(ntotal);
+    {
+        std::mt19937 rng(random_seed * 6007);
+        for (int i = 0; i < ntotal; i++) {
+            graph.push_back(faiss::nndescent::Nhood(L, S, rng, (int)ntotal));
+        }
+    }
+
+    // A few candidates are drawn from the whole database to keep the
+    // clusters connected to each other
+    const int n_global = ntotal > S ? S / 4 : 0;
+    const int n_local = S - n_global;
+
+    // The local candidates of a point are its nearest neighbors in the
+    // block of its clusters, found by one exhaustive search per cluster (a
+    // matrix product). The blocks of unbalanced clusters are subsampled.
+    const size_t max_block =
+        (size_t)8 * nprobe * std::max(ntotal / nlist, S);
+    std::mt19937 rng(random_seed * 7741);
+    std::vector<int> block;
+    std::vector<float> xblock, xmembers;
+    std::vector<faiss::idx_t> knn;
+    std::vector<float> knn_dis;
+    for (int c = 0; c < nlist; c++) {
+        const auto& members = lists[c];
+        if (members.empty()) continue;
+
+        block.clear();
+        for (int p = 0; p < nprobe; p++) {
+            faiss::idx_t c2 = probes[(size_t)c * nprobe + p];
+            if (c2 >= 0) {
+                block.insert(block.end(), lists[c2].begin(), lists[c2].end());
             }
-            if (ok) {
-                new_pool.emplace_back(nn);
+        }
+        if (block.size() > max_block) {
+            for (size_t i = 0; i < max_block; i++) {
+                std::swap(block[i], block[i + rng() % (block.size() - i)]);
             }
+            block.resize(max_block);
         }
 
-        for (auto&& nn : new_pool) {
-            nn.flag = false;
+        xblock.resize(block.size() * d);
+        for (size_t i = 0; i < block.size(); i++) {
+            memcpy(xblock.data() + i * d, x + (size_t)block[i] * d,
+                   sizeof(float) * d);
         }
-        {
-            std::lock_guard<std::mutex> guard(nhood.lock);
-            pool.insert(pool.end(), new_pool.begin(), new_pool.end());
+        xmembers.resize(members.size() * d);
+        for (size_t i = 0; i < members.size(); i++) {
+            memcpy(xmembers.data() + i * d, x + (size_t)members[i] * d,
+                   sizeof(float) * d);
+        }
+        faiss::IndexFlat block_index(d, metric_type);
+        block_index.add(block.size(), xblock.data());
+        const int k = std::min<size_t>(n_local + 1, block.size());
+        knn.resize(members.size() * k);
+        knn_dis.resize(members.size() * k);
+        block_index.search(members.size(), xmembers.data(), k,
+                           knn_dis.data(), knn.data());
+
+        // the pool distances come from qdis, as in the rest of the build
+#pragma omp parallel for
+        for (size_t m = 0; m < members.size(); m++) {
+            const int i = members[m];
+            auto& pool = graph[i].pool;
+            for (int j = 0; j < k && (int)pool.size() < n_local; j++) {
+                faiss::idx_t b = knn[m * k + j];
+                if (b < 0 || block[b] == i) continue;
+                int id = block[b];
+                pool.emplace_back(id, qdis.symmetric_dis(i, id), true);
+            }
+        }
+    }
+
+#pragma omp parallel
+    {
+        std::mt19937 rng(random_seed * 7741 + omp_get_thread_num());
+        std::vector<int> tmp(n_global);
+#pragma omp for
+        for (int i = 0; i < ntotal; i++) {
+            auto& pool = graph[i].pool;
+            if (n_global > 0) {
+                gen_random(rng, tmp.data(), n_global, ntotal);
+            }
+            for (int id : tmp) {
+                if (id == i) continue;
+                pool.emplace_back(id, qdis.symmetric_dis(i, id), true);
+            }
+            std::make_heap(pool.begin(), pool.end());
+            pool.reserve(L);
         }
     }
 }
 
+void RNNDescent::init_graph_from_knn(faiss::DistanceComputer& qdis,
+                                     const faiss::idx_t* knn_graph,
+                                     const int k) {
+    graph.reserve(ntotal);
+    {
+        std::mt19937 rng(random_seed * 6007);
+        for (int i = 0; i < ntotal; i++) {
+            graph.push_back(faiss::nndescent::Nhood(L, S, rng, (int)ntotal));
+        }
+    }
+
+#pragma omp parallel for
+    for (int i = 0; i < ntotal; i++) {
+        const faiss::idx_t* knn = knn_graph + (size_t)i * k;
+        for (int j = 0; j < k; j++) {
+            faiss::idx_t id = knn[j];
+            if (id < 0 || id >= ntotal || id == i) continue;
+            float dist = qdis.symmetric_dis(i, id);
+
+            graph[i].pool.push_back(
+                faiss::nndescent::Neighbor(id, dist, true));
+        }
+        std::make_heap(graph[i].pool.begin(), graph[i].pool.end());
+        graph[i].pool.reserve(L);
+    }
+}
+
+void RNNDescent::insert_nn(int id, int nn_id, float distance, bool flag) {
+    auto& nhood = graph[id];
+    {
+        std::lock_guard<std::mutex> guard(nhood.lock);
+        nhood.pool.emplace_back(nn_id, distance, flag);
+    }
+}
+
+void RNNDescent::update_neighbors(faiss::DistanceComputer& qdis,
+                                  float alpha) {
+    record_simd_level();
+    RNNDESCENT_SIMD_DISPATCH(update_neighbors(*this, qdis, alpha));
+}
+
 void RNNDescent::add_reverse_edges() {
     std::vector<std::vector<faiss::nndescent::Neighbor>> reverse_pools(ntotal);
 
@@ -204,37 +381,90 @@ void RNNDescent::add_reverse_edges() {
     }
 }
 
-void RNNDescent::build(faiss::DistanceComputer& qdis, const int n,
-                       bool verbose) {
-    if (verbose) {
-        printf("Parameters: S=%d, R=%d, T1=%d, T2=%d\n", S, R, T1, T2);
+void RNNDescent::add_border_reverse_edges(
+        const int border, const std::vector<bool>* repaired) {
+#pragma omp parallel for
+    for (int u = 0; u < ntotal; ++u) {
+        std::vector<faiss::nndescent::Neighbor> crossing;
+        {
+            std::lock_guard<std::mutex> guard(graph[u].lock);
+            for (auto&& nn : graph[u].pool) {
+                if ((nn.id < border) != (u < border) ||
+                    (repaired && ((*repaired)[u] || (*repaired)[nn.id]))) {
+                    crossing.push_back(nn);
+                }
+            }
+        }
+        for (auto&& nn : crossing) {
+            insert_nn(nn.id, u, nn.distance, true);
+        }
     }
+}
 
-    ntotal = n;
-    init_graph(qdis);
-
-    for (int t1 = 0; t1 < T1; ++t1) {
+void RNNDescent::refine_graph(faiss::DistanceComputer& qdis,
+                              const int n_iter, bool verbose, bool last,
+                              int first_iter, bool checkpoint,
+                              int border,
+                              const std::vector<bool>* repaired) {
+    bool written = false;
+    for (int t1 = first_iter; t1 < n_iter; ++t1) {
         if (verbose) {
             std::cout << "Iter " << t1 << " : " << std::flush;
         }
+        float iter_alpha = last && t1 == n_iter - 1 ? alpha : 1;
         for (int t2 = 0; t2 < T2; ++t2) {
-            update_neighbors(qdis);
+            update_neighbors(qdis, iter_alpha);
             if (verbose) {
                 std::cout << "#" << std::flush;
             }
         }
 
-        if (t1 != T1 - 1) {
-            add_reverse_edges();
+        if (t1 != n_iter - 1) {
+            if (border > 0) {
+                add_border_reverse_edges(border, repaired);
+            } else {
+                add_reverse_edges();
+            }
+            if (checkpoint) {
+                write_build_checkpoint(checkpoint_fname.c_str(), *this,
+                                       n_iter, t1 + 1);
+                written = true;
+                if (verbose) {
+                    std::cout << " checkpoint" << std::flush;
+                }
+            }
         }
 
         if (verbose) {
             printf("\n");
         }
     }
+    // only the checkpoint of this build is removed
+    if (written) {
+        std::remove(checkpoint_fname.c_str());
+    }
+
+    if (verbose) {
+        printf("Distances: %zu, cache hit rate: %.3f\n",
+               rnndescent_stats.n_dis.load(),
+               rnndescent_stats.cache_hit_rate());
+    }
+}
+
+void RNNDescent::recompute_distances(faiss::DistanceComputer& qdis) {
+#pragma omp parallel for schedule(dynamic, 256)
+    for (int u = 0; u < ntotal; ++u) {
+        for (auto&& nn : graph[u].pool) {
+            nn.distance = qdis.symmetric_dis(u, nn.id);
+        }
+    }
+    // the cached distances are those of the previous distance computer
+    std::vector<DistanceCache>().swap(dis_caches);
+}
 
+void RNNDescent::finalize_graph() {
 #pragma omp parallel for
-    for (int u = 0; u < n; ++u) {
+    for (int u = 0; u < ntotal; ++u) {
         auto& pool = graph[u].pool;
         std::sort(pool.begin(), pool.end());
         pool.erase(std::unique(pool.begin(), pool.end(),
@@ -253,7 +483,7 @@ void RNNDescent::build(faiss::DistanceComputer& qdis, const int n,
 
     final_graph.resize(offsets.back(), -1);
 #pragma omp parallel for
-    for (int u = 0; u < n; ++u) {
+    for (int u = 0; u < ntotal; ++u) {
         auto& pool = graph[u].pool;
         int offset = offsets[u];
         for (int i = 0; i < pool.size(); ++i) {
@@ -261,77 +491,581 @@ void RNNDescent::build(faiss::DistanceComputer& qdis, const int n,
         }
     }
     std::vector<faiss::nndescent::Nhood>().swap(graph);
+    std::vector<DistanceCache>().swap(dis_caches);
 
     has_built = true;
 }
 
-void RNNDescent::search(faiss::DistanceComputer& qdis, const int topk,
-                        faiss::idx_t* indices, float* dists,
-                        faiss::VisitedTable& vt) const {
+void RNNDescent::build(faiss::DistanceComputer& qdis, const int n,
+                       bool verbose, const float* x) {
+    rnndescent_stats.reset();
+    if (verbose) {
+        printf("Parameters: S=%d, R=%d, T1=%d, T2=%d\n", S, R, T1, T2);
+    }
+
+    const bool checkpoint = !checkpoint_fname.empty();
+    if (checkpoint && resume_build(qdis, n, verbose)) {
+        return;
+    }
+
+    ntotal = n;
+    if (init_with_clustering) {
+        init_graph_clustering(qdis, x, verbose);
+    } else {
+        init_graph(qdis);
+    }
+    refine_graph(qdis, T1, verbose, true, 0, checkpoint);
+    finalize_graph();
+    build_hierarchy(qdis);
+}
+
+bool RNNDescent::resume_build(faiss::DistanceComputer& qdis, const int n,
+                              bool verbose, bool warm_start) {
+    const int n_iter = warm_start ? T1_warm_start : T1;
+    int n_done;
+    if (!read_build_checkpoint(checkpoint_fname.c_str(), *this, n, n_iter,
+                               n_done)) {
+        return false;
+    }
+
+    // the distances of random pool entries catch a checkpoint of other
+    // vectors or of another metric
+    std::mt19937 rng(random_seed * 4243);
+    const int n_check = std::min(ntotal, 1024);
+    for (int i = 0; i < n_check; i++) {
+        const int u = rng() % ntotal;
+        const auto& pool = graph[u].pool;
+        if (pool.empty()) continue;
+        const auto& nn = pool[rng() % pool.size()];
+        float dis = qdis.symmetric_dis(u, nn.id);
+        if (std::abs(dis - nn.distance) >
+            1e-4f * std::max(std::abs(dis), 1.0f)) {
+            KNNGraph().swap(graph);
+            ntotal = 0;
+            FAISS_THROW_MSG(
+                "the checkpoint was written for other vectors or metric");
+        }
+    }
+    if (verbose) {
+        printf("Resuming from %s after %d of %d outer iterations\n",
+               checkpoint_fname.c_str(), n_done, n_iter);
+    }
+
+    refine_graph(qdis, n_iter, verbose, true, n_done, true);
+    // the checkpoint resumed from belongs to this build
+    std::remove(checkpoint_fname.c_str());
+    finalize_graph();
+    build_hierarchy(qdis);
+    return true;
+}
+
+void RNNDescent::build_with_proxy(faiss::DistanceComputer& proxy_qdis,
+                                  faiss::DistanceComputer& qdis, const int n,
+                                  bool verbose, const float* x) {
+    if (T1 <= 1) {
+        build(qdis, n, verbose, x);
+        return;
+    }
+    rnndescent_stats.reset();
+    if (verbose) {
+        printf("Parameters: S=%d, R=%d, T1=%d (%d approximate), T2=%d\n", S,
+               R, T1, T1 - 1, T2);
+    }
+
+    ntotal = n;
+    if (init_with_clustering) {
+        init_graph_clustering(proxy_qdis, x, verbose);
+    } else {
+        init_graph(proxy_qdis);
+    }
+    refine_graph(proxy_qdis, T1 - 1, verbose, false);
+
+    // the reverse edges are ranked by their exact distances
+    recompute_distances(qdis);
+    add_reverse_edges();
+    refine_graph(qdis, 1, verbose);
+    finalize_graph();
+    build_hierarchy(qdis);
+}
+
+void RNNDescent::build_from_knn_graph(faiss::DistanceComputer& qdis,
+                                      const int n,
+                                      const faiss::idx_t* knn_graph,
+                                      const int k, bool verbose) {
+    rnndescent_stats.reset();
+    if (verbose) {
+        printf("Parameters: k=%d, R=%d, T1_warm_start=%d, T2=%d\n", k, R,
+               T1_warm_start, T2);
+    }
+
+    const bool checkpoint = !checkpoint_fname.empty();
+    if (checkpoint && resume_build(qdis, n, verbose, true)) {
+        return;
+    }
+
+    ntotal = n;
+    init_graph_from_knn(qdis, knn_graph, k);
+    refine_graph(qdis, T1_warm_start, verbose, true, 0, checkpoint);
+    finalize_graph();
+    build_hierarchy(qdis);
+}
+
+void RNNDescent::merge_from(faiss::DistanceComputer& qdis,
+                            const RNNDescent& other, bool verbose) {
+    rnndescent_stats.reset();
+    const int n0 = ntotal;
+    const int n1 = other.ntotal;
+    if (n1 == 0) {
+        return;
+    }
+    if (n0 == 0) {
+        ntotal = n1;
+        final_graph = other.final_graph;
+        offsets = other.offsets;
+        level_ids = other.level_ids;
+        levels = other.levels;
+        has_built = other.has_built;
+        return;
+    }
+    FAISS_THROW_IF_NOT_MSG(has_built && other.has_built,
+                           "The index is not build yet.");
+
+    // concatenate the two graphs, the ids of other are shifted by n0
+    offsets.resize(n0 + n1 + 1);
+    for (int u = 0; u < n1; ++u) {
+        offsets[n0 + u + 1] = offsets[n0] + other.offsets[u + 1];
+    }
+    final_graph.reserve(offsets.back());
+    for (int v : other.final_graph) {
+        final_graph.push_back(v + n0);
+    }
+    ntotal = n0 + n1;
+
+    if (verbose) {
+        printf("Merging %d + %d vectors\n", n0, n1);
+    }
+
+    // search each vector in the graph of the other shard to find the
+    // candidates for the cross-shard edges
+    const int topk = S;
+    const int search_pool_size = std::max(search_L, S);
+    std::vector<faiss::idx_t> cross_ids((size_t)ntotal * topk);
+    std::vector<float> cross_dists((size_t)ntotal * topk);
+#pragma omp parallel
+    {
+        faiss::VisitedTable vt(ntotal);
+        StoredQueryDistanceComputer sdis(qdis);
+#pragma omp for schedule(dynamic, 256)
+        for (int u = 0; u < ntotal; ++u) {
+            sdis.q = u;
+            int begin = u < n0 ? n0 : 0;
+            int end = u < n0 ? ntotal : n0;
+            search_in_range(sdis, begin, end, topk, search_pool_size,
+                            cross_ids.data() + (size_t)u * topk,
+                            cross_dists.data() + (size_t)u * topk, vt);
+        }
+    }
+
+    // the existing edges are old, only the cross-shard ones are new
+    graph.reserve(ntotal);
+    {
+        std::mt19937 rng(random_seed * 6007);
+        for (int i = 0; i < ntotal; i++) {
+            graph.push_back(faiss::nndescent::Nhood(L, S, rng, (int)ntotal));
+        }
+    }
+
+#pragma omp parallel for
+    for (int u = 0; u < ntotal; ++u) {
+        auto& pool = graph[u].pool;
+        for (int j = offsets[u]; j < offsets[u + 1]; ++j) {
+            int v = final_graph[j];
+            pool.emplace_back(v, qdis.symmetric_dis(u, v), false);
+        }
+        const faiss::idx_t* ids = cross_ids.data() + (size_t)u * topk;
+        const float* dists = cross_dists.data() + (size_t)u * topk;
+        for (int j = 0; j < topk; ++j) {
+            if (ids[j] < 0) continue;
+            pool.emplace_back(ids[j], dists[j], true);
+        }
+    }
+
+    // Since update_neighbors only compares pairs involving a new edge, the
+    // updates stay local to the border between the shards
+    refine_graph(qdis, T1_warm_start, verbose, true, 0, false, n0);
+
+    finalize_graph();
+    build_hierarchy(qdis);
+}
+
+void RNNDescent::update_graph(faiss::DistanceComputer& qdis,
+                              const std::vector<bool>& removed,
+                              const int n_add, const faiss::idx_t* add_knn,
+                              const int k, bool verbose) {
     FAISS_THROW_IF_NOT_MSG(has_built, "The index is not build yet.");
-    int L = std::max(search_L, topk);
+    FAISS_THROW_IF_NOT(removed.size() == (size_t)ntotal);
+    rnndescent_stats.reset();
 
-    // candidate pool, the K best items is the result.
-    std::vector<faiss::nndescent::Neighbor> retset(L + 1);
+    std::vector<int> new_vertex(ntotal, -1);
+    int n_keep = 0;
+    for (int u = 0; u < ntotal; ++u) {
+        if (!removed[u]) {
+            new_vertex[u] = n_keep++;
+        }
+    }
+    FAISS_THROW_IF_NOT_MSG(n_keep > 0, "no vertex left to update from");
+    const int n0 = ntotal;
+    ntotal = n_keep + n_add;
 
-    // Randomly choose L points to initialize the candidate pool
-    std::vector<int> init_ids(L);
-    std::mt19937 rng(random_seed);
+    if (verbose) {
+        printf("Updating the graph: %d removed, %d added\n", n0 - n_keep,
+               n_add);
+    }
 
-    gen_random(rng, init_ids.data(), L, ntotal);
-    for (int i = 0; i < L; i++) {
-        int id = init_ids[i];
-        float dist = qdis(id);
-        retset[i] = faiss::nndescent::Neighbor(id, dist, true);
+    graph.reserve(ntotal);
+    {
+        std::mt19937 rng(random_seed * 6007);
+        for (int i = 0; i < ntotal; i++) {
+            graph.push_back(faiss::nndescent::Nhood(L, S, rng, (int)ntotal));
+        }
     }
 
-    // Maintain the candidate pool in ascending order
-    std::sort(retset.begin(), retset.begin() + L);
+    // the remaining edges are old. The edges to a removed vertex are
+    // replaced by new edges to its neighbors, which keeps its neighborhood
+    // connected. The vertices that get such edges are repaired: their edges
+    // get reverse edges between the iterations, like those of the added
+    // vertices.
+    std::vector<bool> repaired(ntotal);
+    for (int u = 0; u < n0; ++u) {
+        if (removed[u]) continue;
+        for (int j = offsets[u]; j < offsets[u + 1]; ++j) {
+            if (removed[final_graph[j]]) {
+                repaired[new_vertex[u]] = true;
+                break;
+            }
+        }
+    }
+#pragma omp parallel for schedule(dynamic, 256)
+    for (int u = 0; u < n0; ++u) {
+        if (removed[u]) continue;
+        const int nu = new_vertex[u];
+        auto& pool = graph[nu].pool;
+        for (int j = offsets[u]; j < offsets[u + 1]; ++j) {
+            int v = final_graph[j];
+            if (!removed[v]) {
+                int nv = new_vertex[v];
+                pool.emplace_back(nv, qdis.symmetric_dis(nu, nv), false);
+                continue;
+            }
+            for (int e = offsets[v]; e < offsets[v + 1]; ++e) {
+                int w = new_vertex[final_graph[e]];
+                if (w < 0 || w == nu) continue;
+                pool.emplace_back(w, qdis.symmetric_dis(nu, w), true);
+            }
+        }
+    }
 
-    int k = 0;
+    // the added vertices start from their candidates, which get the
+    // reverse edges
+#pragma omp parallel for
+    for (int a = 0; a < n_add; ++a) {
+        const int u = n_keep + a;
+        const faiss::idx_t* knn = add_knn + (size_t)a * k;
+        for (int j = 0; j < k; ++j) {
+            faiss::idx_t v = knn[j];
+            if (v < 0 || v >= ntotal || v == u) continue;
+            float dist = qdis.symmetric_dis(u, v);
+            insert_nn(u, v, dist, true);
+            insert_nn(v, u, dist, true);
+        }
+    }
 
-    // Stop until the smallest position updated is >= L
-    while (k < L) {
-        int nk = L;
+    // as in merge_from, only the pairs that involve a new edge are compared
+    refine_graph(qdis, T1_warm_start, verbose, true, 0, false, n_keep,
+                 &repaired);
 
-        if (retset[k].flag) {
-            retset[k].flag = false;
-            int n = retset[k].id;
+    finalize_graph();
+    build_hierarchy(qdis);
+}
 
-            int offset = offsets[n];
-            int K = std::min(K0, offsets[n + 1] - offset);
-            for (int m = 0; m < K; ++m) {
-                int id = final_graph[offset + m];
-                if (vt.get(id)) continue;
+void RNNDescent::build_hierarchy(faiss::DistanceComputer& qdis) {
+    level_ids.clear();
+    levels.clear();
 
-                vt.set(id);
-                float dist = qdis(id);
-                if (dist >= retset[L - 1].distance) continue;
+    std::vector<int> sizes;
+    for (int size = ntotal / std::max(hierarchy_ratio, 2);
+         sizes.size() < hierarchy_levels && size > S;
+         size /= std::max(hierarchy_ratio, 2)) {
+        sizes.push_back(size);
+    }
+    if (sizes.empty()) {
+        return;
+    }
 
-                faiss::nndescent::Neighbor nn(id, dist, true);
-                int r = insert_into_pool(retset.data(), L, nn);
+    // the levels are the prefixes of a random permutation, so that each one
+    // samples the level below and keeps the positions of its vertices
+    std::vector<int> perm(ntotal);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::mt19937 rng(random_seed * 3571);
+    for (int i = 0; i < sizes[0]; i++) {
+        int j = i + rng() % (ntotal - i);
+        std::swap(perm[i], perm[j]);
+    }
+    level_ids.assign(perm.begin(), perm.begin() + sizes[0]);
 
-                if (r < nk) nk = r;
+    // the stats are those of this graph, not of the level graphs
+    const size_t n_dis = rnndescent_stats.n_dis;
+    const size_t n_cache_hits = rnndescent_stats.n_cache_hits;
+    SubsetDistanceComputer sdis(qdis, level_ids.data());
+    for (int size : sizes) {
+        RNNDescent level_graph(d);
+        level_graph.S = S;
+        level_graph.R = R;
+        level_graph.L = L;
+        level_graph.T1 = T1;
+        level_graph.T2 = T2;
+        level_graph.alpha = alpha;
+        level_graph.random_seed = random_seed + levels.size() + 1;
+        level_graph.build(sdis, size, false);
+
+        NavigationLevel level;
+        level.size = size;
+        level.final_graph = std::move(level_graph.final_graph);
+        level.offsets = std::move(level_graph.offsets);
+        levels.push_back(std::move(level));
+    }
+    rnndescent_stats.n_dis = n_dis;
+    rnndescent_stats.n_cache_hits = n_cache_hits;
+}
+
+int RNNDescent::entry_point(faiss::DistanceComputer& qdis) const {
+    if (levels.empty()) {
+        return -1;
+    }
+
+    int best = 0;
+    float best_dis = qdis(level_ids[0]);
+    for (int l = levels.size() - 1; l >= 0; l--) {
+        // greedy search from the best vertex of the level above, which has
+        // the same position in this level
+        const auto& level = levels[l];
+        int u = -1;
+        while (u != best) {
+            u = best;
+            for (int j = level.offsets[u]; j < level.offsets[u + 1]; j++) {
+                int v = level.final_graph[j];
+                float dis = qdis(level_ids[v]);
+                if (dis < best_dis) {
+                    best = v;
+                    best_dis = dis;
+                }
             }
         }
-        if (nk <= k)
-            k = nk;
-        else
-            ++k;
     }
-    for (size_t i = 0; i < topk; i++) {
-        indices[i] = retset[i].id;
-        dists[i] = retset[i].distance;
+    return level_ids[best];
+}
+
+void RNNDescent::search(faiss::DistanceComputer& qdis, const int topk,
+                        faiss::idx_t* indices, float* dists,
+                        faiss::VisitedTable& vt,
+                        const SearchParametersRNNDescent* params) const {
+    FAISS_THROW_IF_NOT_MSG(has_built, "The index is not build yet.");
+    int pool_size = params && params->search_L > 0 ? params->search_L
+                                                   : search_L;
+    int L = std::max(pool_size, topk);
+    search_in_range(qdis, 0, ntotal, topk, L, indices, dists, vt, params,
+                    entry_point(qdis));
+}
+
+void RNNDescent::search_parallel(faiss::DistanceComputer** team_dis,
+                                 const int n_threads, const int topk,
+                                 faiss::idx_t* indices, float* dists,
+                                 faiss::VisitedTable& vt,
+                                 const SearchParametersRNNDescent* params)
+    const {
+    FAISS_THROW_IF_NOT_MSG(has_built, "The index is not build yet.");
+    int pool_size = params && params->search_L > 0 ? params->search_L
+                                                   : search_L;
+    int L = std::max(pool_size, topk);
+    int entry = entry_point(*team_dis[0]);
+    record_simd_level();
+    RNNDESCENT_SIMD_DISPATCH(search_parallel(*this, team_dis, n_threads, topk,
+                                             L, indices, dists, vt, params,
+                                             entry));
+}
+
+void RNNDescent::search_batch(FlatDistanceComputer& dis, const int nq,
+                              const float* xq, const int topk,
+                              faiss::idx_t* indices, float* dists,
+                              faiss::VisitedTable& vt,
+                              const SearchParametersRNNDescent* params) const {
+    FAISS_THROW_IF_NOT_MSG(has_built, "The index is not build yet.");
+    int pool_size = params && params->search_L > 0 ? params->search_L
+                                                   : search_L;
+    int L = std::max(pool_size, topk);
+    record_simd_level();
+    RNNDESCENT_SIMD_DISPATCH(search_batch(*this, dis, nq, xq, topk, L,
+                                          indices, dists, vt, params));
+}
+
+void RNNDescent::search_in_range(faiss::DistanceComputer& qdis,
+                                 const int begin, const int end,
+                                 const int topk, int L, faiss::idx_t* indices,
+                                 float* dists, faiss::VisitedTable& vt,
+                                 const SearchParametersRNNDescent* params,
+                                 int entry, const float radius,
+                                 std::vector<faiss::nndescent::Neighbor>*
+                                         in_radius) const {
+    record_simd_level();
+    RNNDESCENT_SIMD_DISPATCH(search_in_range(*this, qdis, begin, end, topk, L,
+                                             indices, dists, vt, params,
+                                             entry, radius, in_radius));
+}
+
+void RNNDescent::range_search(
+    faiss::DistanceComputer& qdis, const float radius,
+    std::vector<faiss::nndescent::Neighbor>& result, faiss::VisitedTable& vt,
+    const SearchParametersRNNDescent* params) const {
+    FAISS_THROW_IF_NOT_MSG(has_built, "The index is not build yet.");
+    int pool_size = params && params->search_L > 0 ? params->search_L
+                                                   : search_L;
+    const int L = std::min(std::max(pool_size, S), ntotal);
+
+    // a regular search collects the vertices it meets in the radius. Its
+    // stopping criteria are for the top-k, so that it expands the whole
+    // pool.
+    const size_t n0 = result.size();
+    std::vector<faiss::idx_t> ids(L);
+    std::vector<float> dists(L);
+    search_in_range(qdis, 0, ntotal, L, L, ids.data(), dists.data(), vt,
+                    nullptr, entry_point(qdis), radius, &result);
+
+    // the pool is expanded, the other vertices of the radius are expanded
+    // in the order of result. The vertices met outside the radius are kept
+    // as candidates, the closest L of them, since the pruned edges may go
+    // around the radius: once the radius is done, they are expanded from
+    // the closest one until L expansions in a row find nothing new in it.
+    using Candidate = std::pair<float, int>;
+    std::vector<Candidate> candidates;  // by decreasing distance
+    candidates.reserve(L + 1);
+    auto expand = [&](int u) {
+        bool found = false;
+        int end = offsets[u] + std::min(K0, offsets[u + 1] - offsets[u]);
+        for (int j = offsets[u]; j < end; j++) {
+            int v = final_graph[j];
+            if (vt.get(v)) continue;
+            vt.set(v);
+            float dis = qdis(v);
+            if (dis < radius) {
+                result.emplace_back(v, dis, true);
+                found = true;
+            } else if (candidates.size() < (size_t)L ||
+                       dis < candidates.front().first) {
+                auto pos = std::upper_bound(
+                        candidates.begin(), candidates.end(),
+                        Candidate(dis, v), std::greater<Candidate>());
+                candidates.insert(pos, Candidate(dis, v));
+                if (candidates.size() > (size_t)L) {
+                    candidates.erase(candidates.begin());
+                }
+            }
+        }
+        return found;
+    };
+
+    std::sort(ids.begin(), ids.end());
+    size_t next = n0;
+    int n_idle = 0;
+    while (true) {
+        if (next < result.size()) {
+            int u = result[next++].id;
+            if (!std::binary_search(ids.begin(), ids.end(), u)) {
+                expand(u);
+            }
+        } else if (!candidates.empty() && n_idle < L) {
+            int u = candidates.back().second;
+            candidates.pop_back();
+            n_idle = expand(u) ? 0 : n_idle + 1;
+        } else {
+            break;
+        }
     }
 
     vt.advance();
-};
+}
+
+void RNNDescent::compute_knn_graph(faiss::DistanceComputer& qdis,
+                                   const int k, faiss::idx_t* indices,
+                                   float* dists,
+                                   const SearchParametersRNNDescent* params)
+    const {
+    FAISS_THROW_IF_NOT_MSG(has_built, "The index is not build yet.");
+    FAISS_THROW_IF_NOT(k > 0);
+    int pool_size = params && params->search_L > 0 ? params->search_L
+                                                   : search_L;
+    const int topk = std::min(k + 1, ntotal);
+    const int L = std::max(pool_size, topk);
+
+    std::vector<int> order;
+    order.reserve(ntotal);
+    {
+        std::vector<bool> seen(ntotal);
+        for (int s = 0; s < ntotal; ++s) {
+            if (seen[s]) continue;
+            seen[s] = true;
+            order.push_back(s);
+            for (size_t h = order.size() - 1; h < order.size(); ++h) {
+                int u = order[h];
+                for (int j = offsets[u]; j < offsets[u + 1]; ++j) {
+                    int v = final_graph[j];
+                    if (!seen[v]) {
+                        seen[v] = true;
+                        order.push_back(v);
+                    }
+                }
+            }
+        }
+    }
+
+#pragma omp parallel
+    {
+        faiss::VisitedTable vt(ntotal);
+        StoredQueryDistanceComputer sdis(qdis);
+        std::vector<faiss::idx_t> ids(topk);
+        std::vector<float> ids_dis(topk);
+
+#pragma omp for schedule(dynamic, 256)
+        for (int i = 0; i < ntotal; ++i) {
+            const int u = order[i];
+            sdis.q = u;
+            // the search starts from the vertex itself, which is dropped
+            search_in_range(sdis, 0, ntotal, topk, L, ids.data(),
+                            ids_dis.data(), vt, params, u);
+
+            faiss::idx_t* out = indices + (size_t)u * k;
+            float* out_dis = dists + (size_t)u * k;
+            int j = 0;
+            for (int r = 0; r < topk && j < k; ++r) {
+                if (ids[r] < 0 || ids[r] == u) continue;
+                out[j] = ids[r];
+                out_dis[j] = ids_dis[r];
+                ++j;
+            }
+            for (; j < k; ++j) {
+                out[j] = -1;
+                out_dis[j] = std::numeric_limits<float>::max();
+            }
+        }
+    }
+}
 
 void RNNDescent::reset() {
     has_built = false;
     ntotal = 0;
     final_graph.resize(0);
     offsets.resize(0);
+    level_ids.resize(0);
+    levels.resize(0);
 }
 
 }  // namespace rnndescent
\ No newline at end of file
@@ -1,9 +1,103 @@
+#pragma once
+
+#include <faiss/Index.h>
 #include <faiss/impl/NNDescent.h>
+#include <rnn-descent/simd_level.h>
 
+#include <atomic>
+#include <cstdint>
+#include <string>
 #include <vector>
 
 namespace rnndescent {
 
+/// Direct-mapped cache of the distances between pairs of stored vectors
+struct DistanceCache {
+    std::vector<uint64_t> keys;
+    std::vector<float> values;
+    uint64_t mask;
+
+    // ids are non-negative ints, so the top bit is free
+    static constexpr uint64_t lower_bound_flag = uint64_t(1) << 63;
+
+    /// size is rounded up to a power of 2
+    explicit DistanceCache(size_t size);
+
+    /// number of entries of a cache of the given size
+    static size_t capacity_for(size_t size);
+
+    static uint64_t key(int i, int j) {
+        return i < j ? (uint64_t)i << 32 | (uint32_t)j
+                     : (uint64_t)j << 32 | (uint32_t)i;
+    }
+
+    size_t slot(uint64_t k) const {
+        return (k * 0x9e3779b97f4a7c15ULL >> 20) & mask;
+    }
+
+    /// exact is false if dis is only a lower bound of the distance
+    bool get(int i, int j, float& dis, bool& exact) const {
+        uint64_t k = key(i, j);
+        size_t s = slot(k);
+        if ((keys[s] & ~lower_bound_flag) != k) return false;
+        dis = values[s];
+        exact = !(keys[s] & lower_bound_flag);
+        return true;
+    }
+
+    void set(int i, int j, float dis, bool exact = true) {
+        uint64_t k = key(i, j);
+        size_t s = slot(k);
+        keys[s] = exact ? k : k | lower_bound_flag;
+        values[s] = dis;
+    }
+};
+
+/// The counters of the last build, merge or update, without its level
+/// graphs. They are atomic since concurrent builds add to them
+struct RNNDescentStats {
+    std::atomic<size_t> n_dis{0};  ///< distances computed in update_neighbors
+    std::atomic<size_t> n_cache_hits{0};  ///< distances found in the cache
+    /// level of the last kernels run
+    std::atomic<SIMDLevel> simd_level{SIMDLevel::NONE};
+
+    void reset();
+
+    double cache_hit_rate() const;
+};
+
+extern RNNDescentStats rnndescent_stats;
+
+struct FlatDistanceComputer;
+
+/** Per-call options of the search. The search stops when no candidate of
+ * the pool is left to expand, or earlier with the adaptive criteria below,
+ * so that easy queries do not use the whole budget of hard ones.
+ */
+struct SearchParametersRNNDescent : faiss::SearchParameters {
+    int search_L = 0;  ///< size of candidate pool (0: RNNDescent::search_L)
+
+    /// stop after this many consecutive expansions that do not change the
+    /// top-k results (0: disabled)
+    int patience = 0;
+
+    /// do not expand the candidates farther than distance_ratio (>= 1)
+    /// times the distance of the k-th result (0: disabled). Distances are
+    /// squared for L2, and the ratio applies to |distance| for inner
+    /// products.
+    float distance_ratio = 0;
+
+    ~SearchParametersRNNDescent() {}
+};
+
+/// Upper level of the navigation hierarchy: a graph on the first size
+/// vertices of RNNDescent::level_ids, numbered by their position there
+struct NavigationLevel {
+    int size = 0;
+    std::vector<int> final_graph;
+    std::vector<int> offsets;
+};
+
 struct RNNDescent {
     using storage_idx_t = int;
 
@@ -13,20 +107,174 @@ struct RNNDescent {
 
     ~RNNDescent();
 
-    void build(faiss::DistanceComputer& qdis, const int n, bool verbose);
+    /// x is only required when init_with_clustering is set. If
+    /// checkpoint_fname is set, the build resumes from it when it exists.
+    void build(faiss::DistanceComputer& qdis, const int n, bool verbose,
+               const float* x = nullptr);
+
+    /** Finish the build interrupted after its last checkpoint, which is
+     * read from checkpoint_fname (that of build_from_knn_graph if
+     * warm_start is set). qdis must be on the same n vectors, and the
+     * parameters must be those of the interrupted build. Returns false if
+     * there is no checkpoint.
+     */
+    bool resume_build(faiss::DistanceComputer& qdis, const int n,
+                      bool verbose, bool warm_start = false);
+
+    /** Build the graph with the cheaper distances of proxy_qdis (e.g. on
+     * compressed vectors) for the first T1 - 1 outer iterations. The pool
+     * distances are then recomputed with qdis, which is used for the last
+     * iteration and the final sort.
+     */
+    void build_with_proxy(faiss::DistanceComputer& proxy_qdis,
+                          faiss::DistanceComputer& qdis, const int n,
+                          bool verbose, const float* x = nullptr);
+
+    /// Build the graph starting from an approximate KNN graph (n x k ids,
+    /// -1 for missing entries) instead of a random one. Only T1_warm_start
+    /// outer iterations are run.
+    void build_from_knn_graph(faiss::DistanceComputer& qdis, const int n,
+                              const faiss::idx_t* knn_graph, const int k,
+                              bool verbose);
+
+    /** Append the graph of other (built on the vectors that follow ours in
+     * qdis) and connect the two graphs. The cross-shard candidates are found
+     * by searching each graph with the vectors of the other one, then only
+     * the edges around them are refined.
+     */
+    void merge_from(faiss::DistanceComputer& qdis, const RNNDescent& other,
+                    bool verbose);
+
+    /** Update the graph in place after a change of the vectors: the
+     * vertices u with removed[u] set are dropped and the others renumbered
+     * in the same order, then n_add vertices are appended. add_knn holds
+     * their candidate neighbors (n_add x k ids after the update, -1 for
+     * missing), e.g. found by searching the graph. qdis is on the updated
+     * vectors. Only the edges around the removed and the added vertices
+     * are refined.
+     */
+    void update_graph(faiss::DistanceComputer& qdis,
+                      const std::vector<bool>& removed, const int n_add,
+                      const faiss::idx_t* add_knn, const int k, bool verbose);
 
     void search(faiss::DistanceComputer& qdis, const int topk,
-                faiss::idx_t* indices, float* dists,
-                faiss::VisitedTable& vt) const;
+                faiss::idx_t* indices, float* dists, faiss::VisitedTable& vt,
+                const SearchParametersRNNDescent* params = nullptr) const;
+
+    /// Build the upper levels of the navigation hierarchy, each one a graph
+    /// built by RNN-Descent on a random sample of the level below
+    void build_hierarchy(faiss::DistanceComputer& qdis);
+
+    /// Entry point of the search found by a greedy descent through the
+    /// upper levels, or -1 without hierarchy
+    int entry_point(faiss::DistanceComputer& qdis) const;
+
+    /** Search with a team of n_threads threads, which expand several
+     * candidates of the pool at the same time. This computes more
+     * distances than search, but lowers the latency of a single query.
+     * team_dis[t] is the distance computer of thread t, set to the query.
+     */
+    void search_parallel(faiss::DistanceComputer** team_dis,
+                         const int n_threads, const int topk,
+                         faiss::idx_t* indices, float* dists,
+                         faiss::VisitedTable& vt,
+                         const SearchParametersRNNDescent* params =
+                             nullptr) const;
+
+    /** Search the nq queries xq (nq x d) together. At each round, every
+     * query expands its best unexpanded candidate, and the distances from
+     * all the queries to the union of the new neighbors are computed at
+     * once, so that each candidate is loaded and decoded once for the
+     * batch. The neighbors are offered to the pools of all the queries,
+     * which is worth it when the queries of a batch are close.
+     */
+    void search_batch(FlatDistanceComputer& dis, const int nq,
+                      const float* xq, const int topk, faiss::idx_t* indices,
+                      float* dists, faiss::VisitedTable& vt,
+                      const SearchParametersRNNDescent* params =
+                          nullptr) const;
+
+    /// Search restricted to the vertices in [begin, end), with a pool of
+    /// size L. The edges of these vertices must stay in the range. The pool
+    /// starts from entry if it is set, from random vertices otherwise.
+    /// If in_radius is set, the vertices met at a distance smaller than
+    /// radius are appended to it and vt is left to the caller to advance.
+    void search_in_range(faiss::DistanceComputer& qdis, const int begin,
+                         const int end, const int topk, int L,
+                         faiss::idx_t* indices, float* dists,
+                         faiss::VisitedTable& vt,
+                         const SearchParametersRNNDescent* params = nullptr,
+                         int entry = -1, const float radius = 0,
+                         std::vector<faiss::nndescent::Neighbor>* in_radius =
+                                 nullptr) const;
+
+    /** Append the vertices at a distance smaller than radius from the
+     * query to result. The search starts as search does, then it expands
+     * the vertices met in the radius that its pool did not keep, and the
+     * closest of at most search_L vertices met outside of it for as long as
+     * they lead to new vertices in the radius.
+     */
+    void range_search(faiss::DistanceComputer& qdis, const float radius,
+                      std::vector<faiss::nndescent::Neighbor>& result,
+                      faiss::VisitedTable& vt,
+                      const SearchParametersRNNDescent* params =
+                          nullptr) const;
+
+    /** Top-k neighbors of every vertex (ntotal x k, the vertex itself
+     * excluded, -1 for missing), found by searching the graph from the
+     * vertex with a pool of size max(search_L, k + 1). The vertices are
+     * searched in BFS order, so that the consecutive searches of a thread
+     * read mostly the same vectors and edges.
+     */
+    void compute_knn_graph(faiss::DistanceComputer& qdis, const int k,
+                           faiss::idx_t* indices, float* dists,
+                           const SearchParametersRNNDescent* params =
+                               nullptr) const;
 
     void reset();
 
     /// Initialize the KNN graph randomly
     void init_graph(faiss::DistanceComputer& qdis);
 
-    void update_neighbors(faiss::DistanceComputer& qdis);
+    /// Initialize the KNN graph with the nearest neighbors of each point
+    /// among the members of its nearest clusters
+    void init_graph_clustering(faiss::DistanceComputer& qdis, const float* x,
+                               bool verbose = false);
+
+    /// Initialize the KNN graph with the neighbors of an existing one
+    void init_graph_from_knn(faiss::DistanceComputer& qdis,
+                             const faiss::idx_t* knn_graph, const int k);
+
+    /** Run the outer iterations first_iter to n_iter - 1 of the neighbor
+     * updates. If last is set, the last one prunes with alpha. If
+     * checkpoint is set, the pools are written to checkpoint_fname after
+     * each iteration but the last, and the file is removed at the end. If
+     * border is set, only the edges across it and those of the repaired
+     * vertices get their reverse edges between the iterations (see
+     * add_border_reverse_edges).
+     */
+    void refine_graph(faiss::DistanceComputer& qdis, const int n_iter,
+                      bool verbose, bool last = true, int first_iter = 0,
+                      bool checkpoint = false, int border = 0,
+                      const std::vector<bool>* repaired = nullptr);
+
+    /// Recompute the distances of the candidate pools with qdis
+    void recompute_distances(faiss::DistanceComputer& qdis);
+
+    /// Convert the candidate pools into final_graph and offsets
+    void finalize_graph();
+
+    /// alpha relaxes the pruning of the edges (see RNNDescent::alpha)
+    void update_neighbors(faiss::DistanceComputer& qdis, float alpha = 1);
+
     void add_reverse_edges();
 
+    /// Add the reverse of the edges between a vertex below border and one
+    /// above it, and of the edges from or to a vertex u with (*repaired)[u]
+    /// set, as new edges. The other pools are left as they are.
+    void add_border_reverse_edges(
+            const int border, const std::vector<bool>* repaired = nullptr);
+
     void insert_nn(int id, int nn_id, float distance, bool flag);
 
     bool has_built = false;
@@ -36,18 +284,56 @@ struct RNNDescent {
     int S = 16;
     int R = 96;
     int K0 = 32; // maximum out-degree (mentioned as K in the original paper)
+    int T1_warm_start = 2;  // outer iterations from a KNN graph or a merge
+
+    // relaxation of the pruning in the last outer iteration: the edge to nn
+    // is pruned if alpha * d(other, nn) < d(u, nn) for a kept neighbor
+    // other (for negated inner products, if the similarity is alpha times
+    // larger). alpha > 1 keeps more long-range edges.
+    float alpha = 1.0;
+
+    // total entries of the per-thread distance caches used in
+    // update_neighbors (0: disabled). Worth it when distances are expensive
+    // (large d), and most hits need about one entry per distance of an
+    // outer iteration.
+    size_t dis_cache_size = 0;
+
+    bool init_with_clustering = false;  // k-means based initial graph
+    int init_nlist = 0;   // number of clusters (0: sqrt(ntotal))
+    int init_nprobe = 2;  // clusters each point draws its candidates from
+    // metric of the vectors x of the clustering init, as that of qdis
+    faiss::MetricType metric_type = faiss::METRIC_L2;
+
+    // levels of the navigation hierarchy above the graph (0: the search
+    // starts from random vertices). Level l samples about
+    // ntotal / hierarchy_ratio^l vertices, and has more than S of them.
+    int hierarchy_levels = 0;
+    int hierarchy_ratio = 32;
 
     int search_L = 0;        // size of candidate pool in searching
+    int search_team_size = 1;  // threads per query in IndexRNNDescent::search
+    int search_batch_size = 1;  // batch size of search_with_batches
     int random_seed = 2021;  // random seed for generators
 
+    // file where build and build_from_knn_graph save the candidate pools
+    // after each outer iteration but the last (empty: no checkpoints), so
+    // that an interrupted build can be resumed. It is removed when the
+    // iterations are over. build_with_proxy, merge_from and update_graph
+    // ignore it.
+    std::string checkpoint_fname;
+
     int d;  // dimensions
     int L = 8;  // initial size of memory allocation
 
     int ntotal = 0;
 
     KNNGraph graph;
+    std::vector<DistanceCache> dis_caches;
     std::vector<int> final_graph;
     std::vector<int> offsets;
+
+    std::vector<int> level_ids;  // vertices of the first upper level
+    std::vector<NavigationLevel> levels;  // from the densest to the sparsest
 };
 
 }  // namespace rnndescent
\ No newline at end of file
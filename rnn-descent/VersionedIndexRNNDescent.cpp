@@ -0,0 +1,160 @@
+#include <rnn-descent/IndexFlatBF16.h>
+#include <rnn-descent/VersionedIndexRNNDescent.h>
+
+#include <faiss/clone_index.h>
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/utils/distances.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <limits>
+#include <numeric>
+#include <unordered_set>
+
+namespace rnndescent {
+
+using namespace faiss;
+
+namespace {
+
+Index* clone_storage(const Index& storage) {
+    // clone_index does not know the storages of this library
+    if (auto bf16 = dynamic_cast<const IndexFlatBF16*>(&storage)) {
+        return new IndexFlatBF16(*bf16);
+    }
+    return clone_index(&storage);
+}
+
+/* Copy of index that owns its storage */
+IndexRNNDescent* copy_index(const IndexRNNDescent& index) {
+    auto copy = new IndexRNNDescent(clone_storage(*index.storage));
+    copy->own_fields = true;
+    copy->ntotal = index.ntotal;
+    copy->is_trained = index.is_trained;
+    copy->verbose = index.verbose;
+    copy->cosine = index.cosine;
+    copy->build_with_sq8_proxy = index.build_with_sq8_proxy;
+    copy->numa_interleave = index.numa_interleave;
+    copy->huge_pages = index.huge_pages;
+    copy->rnndescent = index.rnndescent;
+    // the cached results are those of the old vectors
+    if (index.query_cache) {
+        const QueryCache& cache = *index.query_cache;
+        copy->enable_query_cache(cache.shard_capacity * cache.n_shards,
+                                 cache.quantization_step, cache.n_shards);
+    }
+    return copy;
+}
+
+}  // namespace
+
+VersionedIndexRNNDescent::VersionedIndexRNNDescent(IndexRNNDescent* index) {
+    FAISS_THROW_IF_NOT(index && index->storage);
+    FAISS_THROW_IF_NOT(index->is_trained);
+    auto version = std::make_shared<Version>();
+    version->index.reset(index);
+    version->ids.resize(index->ntotal);
+    std::iota(version->ids.begin(), version->ids.end(), 0);
+    version->number = 0;
+    next_id = index->ntotal;
+    current = version;
+}
+
+VersionedIndexRNNDescent::Snapshot VersionedIndexRNNDescent::snapshot() const {
+    return std::atomic_load(&current);
+}
+
+void VersionedIndexRNNDescent::search(idx_t n, const float* x, idx_t k,
+                                      float* distances, idx_t* labels,
+                                      const SearchParameters* params) const {
+    Snapshot version = snapshot();
+    const IndexRNNDescent& index = *version->index;
+    if (index.ntotal == 0) {
+        float worst = is_similarity_metric(index.metric_type)
+                              ? -std::numeric_limits<float>::max()
+                              : std::numeric_limits<float>::max();
+        std::fill(labels, labels + n * k, -1);
+        std::fill(distances, distances + n * k, worst);
+        return;
+    }
+
+    index.search(n, x, k, distances, labels, params);
+    for (idx_t i = 0; i < n * k; i++) {
+        if (labels[i] >= 0) {
+            labels[i] = version->ids[labels[i]];
+        }
+    }
+}
+
+void VersionedIndexRNNDescent::add(idx_t n, const float* x,
+                                   const idx_t* xids) {
+    update(n, x, xids, 0, nullptr);
+}
+
+size_t VersionedIndexRNNDescent::remove_ids(idx_t n, const idx_t* xids) {
+    return update(0, nullptr, nullptr, n, xids);
+}
+
+size_t VersionedIndexRNNDescent::update(idx_t n_add, const float* x,
+                                        const idx_t* xids, idx_t n_remove,
+                                        const idx_t* remove_xids) {
+    std::lock_guard<std::mutex> guard(update_mutex);
+    Snapshot old_version = snapshot();
+    const IndexRNNDescent& old_index = *old_version->index;
+
+    auto version = std::make_shared<Version>();
+    version->number = old_version->number + 1;
+
+    // the kept vectors keep their order, then come the added ones
+    std::unordered_set<idx_t> removed_ids(remove_xids,
+                                          remove_xids + n_remove);
+    std::vector<bool> removed(old_index.ntotal);
+    for (idx_t i = 0; i < old_index.ntotal; i++) {
+        removed[i] = removed_ids.count(old_version->ids[i]) > 0;
+        if (!removed[i]) {
+            version->ids.push_back(old_version->ids[i]);
+        }
+    }
+    const size_t n_removed = old_index.ntotal - version->ids.size();
+
+    // an id names one vector: the explicit ids may not be live after the
+    // removals nor repeat within the batch
+    if (xids) {
+        std::unordered_set<idx_t> live(version->ids.begin(),
+                                       version->ids.end());
+        for (idx_t i = 0; i < n_add; i++) {
+            FAISS_THROW_IF_NOT_FMT(xids[i] >= 0, "negative id %" PRId64,
+                                   xids[i]);
+            FAISS_THROW_IF_NOT_FMT(live.insert(xids[i]).second,
+                                   "duplicate id %" PRId64, xids[i]);
+        }
+    }
+    idx_t new_next_id = next_id;
+    for (idx_t i = 0; i < n_add; i++) {
+        idx_t id = xids ? xids[i] : next_id + i;
+        version->ids.push_back(id);
+        new_next_id = std::max(new_next_id, id + 1);
+    }
+
+    if (verbose) {
+        printf("Version %" PRIu64 ": %zu removed, %" PRId64 " added\n",
+               version->number, n_removed, n_add);
+    }
+
+    // the searches keep reading the old version meanwhile
+    IndexRNNDescent* index = copy_index(old_index);
+    version->index.reset(index);
+    index->verbose = verbose;
+    index->update_vectors(n_add, x, removed);
+    if (!old_index.numa_replicas.empty() && index->rnndescent.has_built) {
+        index->replicate_for_numa();
+    }
+
+    std::atomic_store(&current, Snapshot(version));
+    // only a published version consumes ids
+    next_id = new_next_id;
+    return n_removed;
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <rnn-descent/IndexRNNDescent.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace rnndescent {
+
+/** IndexRNNDescent that can be searched while vectors are added or removed.
+ * Each update builds a new version of the index next to the current one,
+ * then publishes it by an atomic swap of a shared pointer. A search runs on
+ * the version that was current when it started (its snapshot), so it never
+ * waits for an update, and a version is freed when the last search that
+ * holds it returns.
+ *
+ * The graph of a new version is repaired rather than rebuilt (see
+ * IndexRNNDescent::update_vectors). Since every version copies the vectors
+ * and the graph, the updates are worth grouping.
+ */
+struct VersionedIndexRNNDescent {
+    struct Version {
+        std::unique_ptr<IndexRNNDescent> index;
+        /// the updates renumber the vectors of index, ids[i] is the id of
+        /// vector i, which does not change
+        std::vector<idx_t> ids;
+        uint64_t number;
+    };
+    using Snapshot = std::shared_ptr<const Version>;
+
+    /// read and written with std::atomic_load / std::atomic_store
+    Snapshot current;
+
+    std::mutex update_mutex;  // the updates are applied one at a time
+    idx_t next_id;            // default id of the next added vector
+    bool verbose = false;
+
+    /// Takes ownership of index, which must be trained. Its vectors get the
+    /// ids 0 to ntotal - 1.
+    explicit VersionedIndexRNNDescent(IndexRNNDescent* index);
+
+    /// the version to run searches on, it stays valid while it is held
+    Snapshot snapshot() const;
+
+    /// search the current version, the labels are ids
+    void search(idx_t n, const float* x, idx_t k, float* distances,
+                idx_t* labels,
+                const faiss::SearchParameters* params = nullptr) const;
+
+    /// ids from next_id onwards if xids is nullptr. The explicit ids must
+    /// be distinct and not live, otherwise it throws.
+    void add(idx_t n, const float* x, const idx_t* xids = nullptr);
+
+    /// returns the number of vectors removed
+    size_t remove_ids(idx_t n, const idx_t* xids);
+
+    /// Remove the vectors of ids remove_xids, then add x, in a single new
+    /// version. Returns the number of vectors removed.
+    size_t update(idx_t n_add, const float* x, const idx_t* xids,
+                  idx_t n_remove, const idx_t* remove_xids);
+};
+
+}  // namespace rnndescent
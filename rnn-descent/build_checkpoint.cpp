@@ -0,0 +1,143 @@
+#include <rnn-descent/build_checkpoint.h>
+
+#include <faiss/impl/FaissAssert.h>
+#include <rnn-descent/file_io.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace rnndescent {
+
+namespace {
+
+const char checkpoint_magic[4] = {'R', 'N', 'N', 'C'};
+const int32_t checkpoint_version = 2;
+
+// vertices whose pools are written or read at once
+const int block_size = 1 << 16;
+
+}  // namespace
+
+void write_build_checkpoint(const char* fname, const RNNDescent& rnnd,
+                            int n_iter, int n_done) {
+    FAISS_THROW_IF_NOT(rnnd.graph.size() == (size_t)rnnd.ntotal);
+    const std::string tmp_fname = std::string(fname) + ".tmp";
+    {
+        File f = open_file(tmp_fname.c_str(), "wb");
+
+        int32_t header[8] = {checkpoint_version, rnnd.ntotal, n_iter, n_done,
+                             rnnd.S, rnnd.R, rnnd.T2, rnnd.K0};
+        write_or_throw(checkpoint_magic, 1, 4, f.get());
+        write_or_throw(header, sizeof(int32_t), 8, f.get());
+        write_or_throw(&rnnd.alpha, sizeof(float), 1, f.get());
+
+        std::vector<int32_t> sizes, ids;
+        std::vector<float> distances;
+        std::vector<uint8_t> flags;
+        for (int i0 = 0; i0 < rnnd.ntotal; i0 += block_size) {
+            int i1 = std::min(i0 + block_size, rnnd.ntotal);
+            sizes.clear();
+            ids.clear();
+            distances.clear();
+            flags.clear();
+            for (int u = i0; u < i1; u++) {
+                const auto& pool = rnnd.graph[u].pool;
+                sizes.push_back(pool.size());
+                for (auto&& nn : pool) {
+                    ids.push_back(nn.id);
+                    distances.push_back(nn.distance);
+                    flags.push_back(nn.flag);
+                }
+            }
+            write_or_throw(sizes.data(), sizeof(int32_t), sizes.size(),
+                           f.get());
+            write_or_throw(ids.data(), sizeof(int32_t), ids.size(), f.get());
+            write_or_throw(distances.data(), sizeof(float), distances.size(),
+                           f.get());
+            write_or_throw(flags.data(), 1, flags.size(), f.get());
+        }
+
+        // the checkpoint is only useful if it survives the machine
+        FAISS_THROW_IF_NOT_MSG(
+            fflush(f.get()) == 0 && fsync(fileno(f.get())) == 0,
+            "could not write the file");
+    }
+    FAISS_THROW_IF_NOT_FMT(rename(tmp_fname.c_str(), fname) == 0,
+                           "could not rename %s: %s", tmp_fname.c_str(),
+                           strerror(errno));
+}
+
+bool read_build_checkpoint(const char* fname, RNNDescent& rnnd, int n,
+                           int n_iter, int& n_done) {
+    if (access(fname, F_OK) != 0) {
+        return false;
+    }
+    File f = open_file(fname, "rb");
+
+    char magic[4];
+    int32_t header[8];
+    float alpha;
+    read_or_throw(magic, 1, 4, f.get());
+    FAISS_THROW_IF_NOT_FMT(memcmp(magic, checkpoint_magic, 4) == 0,
+                           "%s is not a build checkpoint", fname);
+    read_or_throw(header, sizeof(int32_t), 1, f.get());
+    FAISS_THROW_IF_NOT_FMT(header[0] == checkpoint_version,
+                           "unsupported checkpoint version %d", header[0]);
+    read_or_throw(header + 1, sizeof(int32_t), 7, f.get());
+    read_or_throw(&alpha, sizeof(float), 1, f.get());
+
+    FAISS_THROW_IF_NOT_FMT(header[1] == n,
+                           "the checkpoint is of %d vectors instead of %d",
+                           header[1], n);
+    FAISS_THROW_IF_NOT_FMT(
+        header[2] == n_iter && header[4] == rnnd.S && header[5] == rnnd.R &&
+            header[6] == rnnd.T2 && header[7] == rnnd.K0 &&
+            alpha == rnnd.alpha,
+        "the checkpoint was written by a build with other parameters "
+        "(%d outer iterations, S=%d, R=%d, T2=%d, K0=%d, alpha=%g)",
+        header[2], header[4], header[5], header[6], header[7], alpha);
+    FAISS_THROW_IF_NOT(0 <= header[3] && header[3] <= header[2]);
+    rnnd.ntotal = n;
+    n_done = header[3];
+
+    RNNDescent::KNNGraph(rnnd.ntotal).swap(rnnd.graph);
+    std::vector<int32_t> sizes, ids;
+    std::vector<float> distances;
+    std::vector<uint8_t> flags;
+    for (int i0 = 0; i0 < rnnd.ntotal; i0 += block_size) {
+        int i1 = std::min(i0 + block_size, rnnd.ntotal);
+        sizes.resize(i1 - i0);
+        read_or_throw(sizes.data(), sizeof(int32_t), sizes.size(), f.get());
+        size_t total = 0;
+        for (int32_t size : sizes) {
+            FAISS_THROW_IF_NOT(size >= 0);
+            total += size;
+        }
+        ids.resize(total);
+        distances.resize(total);
+        flags.resize(total);
+        read_or_throw(ids.data(), sizeof(int32_t), total, f.get());
+        read_or_throw(distances.data(), sizeof(float), total, f.get());
+        read_or_throw(flags.data(), 1, total, f.get());
+
+        size_t j = 0;
+        for (int u = i0; u < i1; u++) {
+            auto& pool = rnnd.graph[u].pool;
+            pool.reserve(std::max<int>(sizes[u - i0], rnnd.L));
+            for (int32_t s = 0; s < sizes[u - i0]; s++, j++) {
+                FAISS_THROW_IF_NOT(0 <= ids[j] && ids[j] < rnnd.ntotal);
+                pool.emplace_back(ids[j], distances[j], flags[j] != 0);
+            }
+        }
+    }
+    return true;
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <rnn-descent/RNNDescent.h>
+
+namespace rnndescent {
+
+/** Write the candidate pools of a build in progress (rnnd.graph) after
+ * n_done of its n_iter outer iterations. The file is written next to fname
+ * and renamed over it once complete, so that an interrupted write leaves the
+ * previous checkpoint intact. It holds the 4 bytes "RNNC", then as int32 a
+ * version, ntotal, n_iter, n_done and the parameters S, R, T2 and K0, alpha
+ * as float32, then the pools by blocks of vertices: their sizes as int32,
+ * and the ids (int32), distances (float32) and new flags (uint8) of their
+ * neighbors, in native byte order.
+ */
+void write_build_checkpoint(const char* fname, const RNNDescent& rnnd,
+                            int n_iter, int n_done);
+
+/** Read a file written by write_build_checkpoint into rnnd.graph and
+ * rnnd.ntotal. Throws if it is not of n vectors, of n_iter outer iterations
+ * and of the parameters of rnnd. Returns false if fname does not exist.
+ */
+bool read_build_checkpoint(const char* fname, RNNDescent& rnnd, int n,
+                           int n_iter, int& n_done);
+
+}  // namespace rnndescent
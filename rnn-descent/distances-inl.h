@@ -0,0 +1,515 @@
+#pragma once
+
+/* Distance kernels, compiled once per SIMD level. The including file
+   defines RNNDESCENT_SIMD_NS, the namespace of the level, and the
+   instruction set of the level (see simd_target.h). */
+
+#include <faiss/utils/fp16.h>
+#include <rnn-descent/distances.h>
+#include <rnn-descent/simd_target.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#ifndef RNNDESCENT_SIMD_NS
+#error "RNNDESCENT_SIMD_NS must be defined"
+#endif
+
+RNNDESCENT_TARGET_BEGIN
+
+namespace rnndescent {
+namespace RNNDESCENT_SIMD_NS {
+
+/**************************************************************
+ * SIMD registers of floats
+ **************************************************************/
+
+#if defined(RNNDESCENT_TARGET_AVX512)
+
+#define RNNDESCENT_SIMD_WIDTH 16
+
+struct simd_float {
+    __m512 v;
+
+    static simd_float zero() { return {_mm512_setzero_ps()}; }
+    static simd_float load(const float* x) { return {_mm512_loadu_ps(x)}; }
+    float sum() const { return _mm512_reduce_add_ps(v); }
+};
+
+inline simd_float operator+(simd_float a, simd_float b) {
+    return {_mm512_add_ps(a.v, b.v)};
+}
+
+inline simd_float operator-(simd_float a, simd_float b) {
+    return {_mm512_sub_ps(a.v, b.v)};
+}
+
+inline simd_float operator*(simd_float a, simd_float b) {
+    return {_mm512_mul_ps(a.v, b.v)};
+}
+
+/// a * b + c
+inline simd_float fmadd(simd_float a, simd_float b, simd_float c) {
+    return {_mm512_fmadd_ps(a.v, b.v, c.v)};
+}
+
+#elif defined(RNNDESCENT_TARGET_AVX2)
+
+#define RNNDESCENT_SIMD_WIDTH 8
+
+struct simd_float {
+    __m256 v;
+
+    static simd_float zero() { return {_mm256_setzero_ps()}; }
+    static simd_float load(const float* x) { return {_mm256_loadu_ps(x)}; }
+    float sum() const {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                              _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_movehdup_ps(s));
+        return _mm_cvtss_f32(s);
+    }
+};
+
+inline simd_float operator+(simd_float a, simd_float b) {
+    return {_mm256_add_ps(a.v, b.v)};
+}
+
+inline simd_float operator-(simd_float a, simd_float b) {
+    return {_mm256_sub_ps(a.v, b.v)};
+}
+
+inline simd_float operator*(simd_float a, simd_float b) {
+    return {_mm256_mul_ps(a.v, b.v)};
+}
+
+/// a * b + c
+inline simd_float fmadd(simd_float a, simd_float b, simd_float c) {
+    return {_mm256_fmadd_ps(a.v, b.v, c.v)};
+}
+
+#endif
+
+/**************************************************************
+ * Codecs of the stored components
+ *
+ * decode(x, i) returns the component i of the encoded vector x and
+ * decode_simd(x, i) the components i to i + RNNDESCENT_SIMD_WIDTH - 1.
+ * The codecs are built from the params of FlatKernels.
+ **************************************************************/
+
+struct CodecFloat {
+    using T = float;
+
+    CodecFloat(const float* params = nullptr, size_t d = 0) {}
+
+    float decode(const T* x, size_t i) const { return x[i]; }
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+    simd_float decode_simd(const T* x, size_t i) const {
+        return simd_float::load(x + i);
+    }
+#endif
+};
+
+struct CodecFP16 {
+    using T = uint16_t;
+
+    CodecFP16(const float* params = nullptr, size_t d = 0) {}
+
+#ifdef RNNDESCENT_TARGET_ISA
+    float decode(const T* x, size_t i) const { return _cvtsh_ss(x[i]); }
+#else
+    float decode(const T* x, size_t i) const {
+        return faiss::decode_fp16(x[i]);
+    }
+#endif
+
+#if defined(RNNDESCENT_TARGET_AVX512)
+    simd_float decode_simd(const T* x, size_t i) const {
+        return {_mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(x + i)))};
+    }
+#elif defined(RNNDESCENT_TARGET_AVX2)
+    simd_float decode_simd(const T* x, size_t i) const {
+        return {_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x + i)))};
+    }
+#endif
+};
+
+struct CodecBF16 {
+    using T = uint16_t;
+
+    CodecBF16(const float* params = nullptr, size_t d = 0) {}
+
+    float decode(const T* x, size_t i) const { return decode_bf16(x[i]); }
+
+#if defined(RNNDESCENT_TARGET_AVX512)
+    simd_float decode_simd(const T* x, size_t i) const {
+        __m512i c = _mm512_cvtepu16_epi32(
+            _mm256_loadu_si256((const __m256i*)(x + i)));
+        return {_mm512_castsi512_ps(_mm512_slli_epi32(c, 16))};
+    }
+#elif defined(RNNDESCENT_TARGET_AVX2)
+    simd_float decode_simd(const T* x, size_t i) const {
+        __m256i c =
+            _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(x + i)));
+        return {_mm256_castsi256_ps(_mm256_slli_epi32(c, 16))};
+    }
+#endif
+};
+
+struct CodecUInt8 {
+    using T = uint8_t;
+
+    CodecUInt8(const float* params = nullptr, size_t d = 0) {}
+
+    float decode(const T* x, size_t i) const { return x[i]; }
+
+#if defined(RNNDESCENT_TARGET_AVX512)
+    static simd_float load(const T* x) {
+        __m128i c = _mm_loadu_si128((const __m128i*)x);
+        return {_mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(c))};
+    }
+#elif defined(RNNDESCENT_TARGET_AVX2)
+    static simd_float load(const T* x) {
+        __m128i c = _mm_loadl_epi64((const __m128i*)x);
+        return {_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(c))};
+    }
+#endif
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+    simd_float decode_simd(const T* x, size_t i) const { return load(x + i); }
+#endif
+};
+
+struct CodecSQ8 {
+    using T = uint8_t;
+
+    const float* offset;
+    const float* scale;
+
+    CodecSQ8(const float* params, size_t d)
+        : offset(params), scale(params + d) {}
+
+    float decode(const T* x, size_t i) const {
+        return offset[i] + x[i] * scale[i];
+    }
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+    simd_float decode_simd(const T* x, size_t i) const {
+        return fmadd(CodecUInt8::load(x + i), simd_float::load(scale + i),
+                     simd_float::load(offset + i));
+    }
+#endif
+};
+
+/**************************************************************
+ * Distance kernels
+ *
+ * D > 0 fixes the dimension at compile time, so that the loops have a
+ * constant trip count and are unrolled. D = 0 uses the runtime d.
+ **************************************************************/
+
+template <faiss::MetricType metric>
+inline float term(float x, float y) {
+    if (metric == faiss::METRIC_L2) {
+        float tmp = x - y;
+        return tmp * tmp;
+    }
+    return x * y;
+}
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+template <faiss::MetricType metric>
+inline simd_float accumulate(simd_float acc, simd_float x, simd_float y) {
+    if (metric == faiss::METRIC_L2) {
+        x = x - y;
+        y = x;
+    }
+    return fmadd(x, y, acc);
+}
+#endif
+
+/// Terms of the components i of two encoded vectors
+template <faiss::MetricType metric, class CX, class CY>
+struct PairTerm {
+    static float term(const CX& cx, const typename CX::T* x, const CY& cy,
+                      const typename CY::T* y, size_t i) {
+        return RNNDESCENT_SIMD_NS::term<metric>(cx.decode(x, i),
+                                                cy.decode(y, i));
+    }
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+    static simd_float accumulate(simd_float acc, const CX& cx,
+                                 const typename CX::T* x, const CY& cy,
+                                 const typename CY::T* y, size_t i) {
+        return RNNDESCENT_SIMD_NS::accumulate<metric>(
+            acc, cx.decode_simd(x, i), cy.decode_simd(y, i));
+    }
+#endif
+};
+
+/// The offsets of two SQ8 codes cancel out in their difference
+template <>
+struct PairTerm<faiss::METRIC_L2, CodecSQ8, CodecSQ8> {
+    static float term(const CodecSQ8& cx, const uint8_t* x, const CodecSQ8& cy,
+                      const uint8_t* y, size_t i) {
+        float diff = (float(x[i]) - float(y[i])) * cx.scale[i];
+        return diff * diff;
+    }
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+    static simd_float accumulate(simd_float acc, const CodecSQ8& cx,
+                                 const uint8_t* x, const CodecSQ8& cy,
+                                 const uint8_t* y, size_t i) {
+        simd_float diff = (CodecUInt8::load(x + i) - CodecUInt8::load(y + i)) *
+                          simd_float::load(cx.scale + i);
+        return fmadd(diff, diff, acc);
+    }
+#endif
+};
+
+/// Squared L2 distance or inner product between x and y
+template <faiss::MetricType metric, int D, class CX, class CY>
+inline float distance(const CX& cx, const typename CX::T* x, const CY& cy,
+                      const typename CY::T* y, size_t d) {
+    using Term = PairTerm<metric, CX, CY>;
+    const size_t dim = D > 0 ? D : d;
+    size_t i = 0;
+    float res = 0;
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+    constexpr size_t W = RNNDESCENT_SIMD_WIDTH;
+    simd_float acc0 = simd_float::zero();
+    simd_float acc1 = simd_float::zero();
+    for (; i + 2 * W <= dim; i += 2 * W) {
+        acc0 = Term::accumulate(acc0, cx, x, cy, y, i);
+        acc1 = Term::accumulate(acc1, cx, x, cy, y, i + W);
+    }
+    if (i + W <= dim) {
+        acc0 = Term::accumulate(acc0, cx, x, cy, y, i);
+        i += W;
+    }
+    res = (acc0 + acc1).sum();
+#endif
+
+#pragma omp simd reduction(+ : res)
+    for (size_t j = i; j < dim; j++) {
+        res += Term::term(cx, x, cy, y, j);
+    }
+    return res;
+}
+
+/// Distances between the float query q and 4 vectors, q is loaded once
+template <faiss::MetricType metric, int D, class Codec>
+inline void distance_batch_4(const float* q, const Codec& codec,
+                             const typename Codec::T* y0,
+                             const typename Codec::T* y1,
+                             const typename Codec::T* y2,
+                             const typename Codec::T* y3, size_t d,
+                             float& dis0, float& dis1, float& dis2,
+                             float& dis3) {
+    const size_t dim = D > 0 ? D : d;
+    size_t i = 0;
+    dis0 = dis1 = dis2 = dis3 = 0;
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+    constexpr size_t W = RNNDESCENT_SIMD_WIDTH;
+    simd_float acc0 = simd_float::zero();
+    simd_float acc1 = simd_float::zero();
+    simd_float acc2 = simd_float::zero();
+    simd_float acc3 = simd_float::zero();
+    for (; i + W <= dim; i += W) {
+        simd_float qi = simd_float::load(q + i);
+        acc0 = accumulate<metric>(acc0, qi, codec.decode_simd(y0, i));
+        acc1 = accumulate<metric>(acc1, qi, codec.decode_simd(y1, i));
+        acc2 = accumulate<metric>(acc2, qi, codec.decode_simd(y2, i));
+        acc3 = accumulate<metric>(acc3, qi, codec.decode_simd(y3, i));
+    }
+    dis0 = acc0.sum();
+    dis1 = acc1.sum();
+    dis2 = acc2.sum();
+    dis3 = acc3.sum();
+#endif
+
+    for (; i < dim; i++) {
+        dis0 += term<metric>(q[i], codec.decode(y0, i));
+        dis1 += term<metric>(q[i], codec.decode(y1, i));
+        dis2 += term<metric>(q[i], codec.decode(y2, i));
+        dis3 += term<metric>(q[i], codec.decode(y3, i));
+    }
+}
+
+/// Distances between the float queries q0..q3 and y, y is decoded once
+template <faiss::MetricType metric, int D, class Codec>
+inline void distance_queries_4(const float* q0, const float* q1,
+                               const float* q2, const float* q3,
+                               const Codec& codec,
+                               const typename Codec::T* y, size_t d,
+                               float& dis0, float& dis1, float& dis2,
+                               float& dis3) {
+    const size_t dim = D > 0 ? D : d;
+    size_t i = 0;
+    dis0 = dis1 = dis2 = dis3 = 0;
+
+#ifdef RNNDESCENT_SIMD_WIDTH
+    constexpr size_t W = RNNDESCENT_SIMD_WIDTH;
+    simd_float acc0 = simd_float::zero();
+    simd_float acc1 = simd_float::zero();
+    simd_float acc2 = simd_float::zero();
+    simd_float acc3 = simd_float::zero();
+    for (; i + W <= dim; i += W) {
+        simd_float yi = codec.decode_simd(y, i);
+        acc0 = accumulate<metric>(acc0, simd_float::load(q0 + i), yi);
+        acc1 = accumulate<metric>(acc1, simd_float::load(q1 + i), yi);
+        acc2 = accumulate<metric>(acc2, simd_float::load(q2 + i), yi);
+        acc3 = accumulate<metric>(acc3, simd_float::load(q3 + i), yi);
+    }
+    dis0 = acc0.sum();
+    dis1 = acc1.sum();
+    dis2 = acc2.sum();
+    dis3 = acc3.sum();
+#endif
+
+    for (; i < dim; i++) {
+        float yi = codec.decode(y, i);
+        dis0 += term<metric>(q0[i], yi);
+        dis1 += term<metric>(q1[i], yi);
+        dis2 += term<metric>(q2[i], yi);
+        dis3 += term<metric>(q3[i], yi);
+    }
+}
+
+/// Squared L2 distance between x and y if it is smaller than bound,
+/// otherwise any value >= bound. The bound is checked every 32 dimensions.
+template <int D, class CX, class CY>
+inline float l2sqr_bounded(const CX& cx, const typename CX::T* x, const CY& cy,
+                           const typename CY::T* y, size_t d, float bound) {
+    using Term = PairTerm<faiss::METRIC_L2, CX, CY>;
+    const size_t dim = D > 0 ? D : d;
+    size_t i = 0;
+    float res = 0;
+
+    for (; i + 32 <= dim; i += 32) {
+#ifdef RNNDESCENT_SIMD_WIDTH
+        constexpr size_t W = RNNDESCENT_SIMD_WIDTH;
+        simd_float acc = simd_float::zero();
+        for (size_t j = i; j < i + 32; j += W) {
+            acc = Term::accumulate(acc, cx, x, cy, y, j);
+        }
+        res += acc.sum();
+#else
+        float partial = 0;
+#pragma omp simd reduction(+ : partial)
+        for (size_t j = i; j < i + 32; j++) {
+            partial += Term::term(cx, x, cy, y, j);
+        }
+        res += partial;
+#endif
+        if (res >= bound) {
+            return res;
+        }
+    }
+    for (; i < dim; i++) {
+        res += Term::term(cx, x, cy, y, i);
+    }
+    return res;
+}
+
+float fvec_L2sqr_bounded(const float* x, const float* y, size_t d,
+                         float bound) {
+    CodecFloat codec;
+    return l2sqr_bounded<0>(codec, x, codec, y, d, bound);
+}
+
+/**************************************************************
+ * Kernels of the FlatDistanceComputer
+ **************************************************************/
+
+template <class Codec, faiss::MetricType metric>
+struct FlatKernelsImpl {
+    using T = typename Codec::T;
+
+    static float sign(float dis) {
+        return metric == faiss::METRIC_L2 ? dis : -dis;
+    }
+
+    static float query_dis(const float* q, const uint8_t* y, size_t d,
+                           const float* params) {
+        return sign(distance<metric, 0>(CodecFloat(), q, Codec(params, d),
+                                        (const T*)y, d));
+    }
+
+    static void queries_dis(const float* q, size_t nq, const uint8_t* y,
+                            size_t d, const float* params, float* dis) {
+        Codec codec(params, d);
+        size_t i = 0;
+        for (; i + 4 <= nq; i += 4) {
+            const float* qi = q + i * d;
+            distance_queries_4<metric, 0>(qi, qi + d, qi + 2 * d, qi + 3 * d,
+                                          codec, (const T*)y, d, dis[i],
+                                          dis[i + 1], dis[i + 2], dis[i + 3]);
+        }
+        for (; i < nq; i++) {
+            dis[i] = distance<metric, 0>(CodecFloat(), q + i * d, codec,
+                                         (const T*)y, d);
+        }
+        for (i = 0; i < nq; i++) {
+            dis[i] = sign(dis[i]);
+        }
+    }
+
+    static float symmetric_dis(const uint8_t* x, const uint8_t* y, size_t d,
+                               const float* params) {
+        Codec codec(params, d);
+        return sign(distance<metric, 0>(codec, (const T*)x, codec,
+                                        (const T*)y, d));
+    }
+
+    static float symmetric_dis_bounded(const uint8_t* x, const uint8_t* y,
+                                       size_t d, const float* params,
+                                       float bound) {
+        if (metric != faiss::METRIC_L2) {
+            return symmetric_dis(x, y, d, params);
+        }
+        Codec codec(params, d);
+        return l2sqr_bounded<0>(codec, (const T*)x, codec, (const T*)y, d,
+                                bound);
+    }
+
+    static const FlatKernels& get() {
+        static const FlatKernels kernels = {&query_dis, &queries_dis,
+                                            &symmetric_dis,
+                                            &symmetric_dis_bounded};
+        return kernels;
+    }
+};
+
+template <class Codec>
+const FlatKernels& get_flat_kernels(faiss::MetricType metric) {
+    if (metric == faiss::METRIC_L2) {
+        return FlatKernelsImpl<Codec, faiss::METRIC_L2>::get();
+    }
+    return FlatKernelsImpl<Codec, faiss::METRIC_INNER_PRODUCT>::get();
+}
+
+const FlatKernels& get_flat_kernels(FlatCodec codec,
+                                    faiss::MetricType metric) {
+    switch (codec) {
+        case FlatCodec::FP16:
+            return get_flat_kernels<CodecFP16>(metric);
+        case FlatCodec::BF16:
+            return get_flat_kernels<CodecBF16>(metric);
+        case FlatCodec::UInt8:
+            return get_flat_kernels<CodecUInt8>(metric);
+        case FlatCodec::SQ8:
+            return get_flat_kernels<CodecSQ8>(metric);
+        default:
+            return get_flat_kernels<CodecFloat>(metric);
+    }
+}
+
+}  // namespace RNNDESCENT_SIMD_NS
+}  // namespace rnndescent
+
+RNNDESCENT_TARGET_END
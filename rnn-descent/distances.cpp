@@ -0,0 +1,16 @@
+#include <rnn-descent/distances.h>
+#include <rnn-descent/simd_dispatch.h>
+
+namespace rnndescent {
+
+float fvec_L2sqr_bounded(const float* x, const float* y, size_t d,
+                         float bound) {
+    RNNDESCENT_SIMD_DISPATCH(fvec_L2sqr_bounded(x, y, d, bound));
+}
+
+const FlatKernels& get_flat_kernels(FlatCodec codec,
+                                    faiss::MetricType metric) {
+    RNNDESCENT_SIMD_DISPATCH(get_flat_kernels(codec, metric));
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <faiss/MetricType.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace rnndescent {
+
+/// Squared L2 distance between x and y if it is smaller than bound.
+/// Otherwise the computation may stop early and return any value >= bound.
+float fvec_L2sqr_bounded(const float* x, const float* y, size_t d,
+                         float bound);
+
+/// Encoding of the components of the vectors in a flat storage
+enum class FlatCodec {
+    Float,
+    FP16,   // IEEE half precision, as ScalarQuantizer::QT_fp16
+    UInt8,  // unsigned 8-bit integers, as ScalarQuantizer::QT_8bit_direct
+    BF16,   // bfloat16, the upper half of a float
+    SQ8,    // 8-bit codes c decoded as offset[i] + c * scale[i], the params
+            // are offset[d] followed by scale[d] (ScalarQuantizer::QT_8bit)
+};
+
+/** Distance kernels between encoded vectors of d components. Inner products
+ * are negated, so that smaller is better. params are the decoding
+ * parameters of the codec, nullptr if it has none.
+ */
+struct FlatKernels {
+    float (*query_dis)(const float* q, const uint8_t* y, size_t d,
+                       const float* params);
+    /// distances between the nq queries q (nq x d) and y, in dis[nq]
+    void (*queries_dis)(const float* q, size_t nq, const uint8_t* y,
+                        size_t d, const float* params, float* dis);
+    float (*symmetric_dis)(const uint8_t* x, const uint8_t* y, size_t d,
+                           const float* params);
+    /// distance if it is smaller than bound, otherwise any value >= bound
+    float (*symmetric_dis_bounded)(const uint8_t* x, const uint8_t* y,
+                                   size_t d, const float* params,
+                                   float bound);
+};
+
+/// Kernels compiled for the current simd_level()
+const FlatKernels& get_flat_kernels(FlatCodec codec, faiss::MetricType metric);
+
+/// bfloat16 nearest to x, ties to even
+inline uint16_t encode_bf16(float x) {
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    u += 0x7fff + ((u >> 16) & 1);
+    return u >> 16;
+}
+
+inline float decode_bf16(uint16_t x) {
+    uint32_t u = uint32_t(x) << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <faiss/impl/FaissAssert.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+namespace rnndescent {
+
+// helpers of the binary files written by the library (KNN graphs, build
+// checkpoints)
+
+struct FileCloser {
+    void operator()(FILE* f) const { fclose(f); }
+};
+using File = std::unique_ptr<FILE, FileCloser>;
+
+inline File open_file(const char* fname, const char* mode) {
+    File f(fopen(fname, mode));
+    FAISS_THROW_IF_NOT_FMT(f, "could not open %s: %s", fname,
+                           strerror(errno));
+    return f;
+}
+
+inline void write_or_throw(const void* ptr, size_t size, size_t n, FILE* f) {
+    FAISS_THROW_IF_NOT_MSG(fwrite(ptr, size, n, f) == n,
+                           "could not write the file");
+}
+
+inline void read_or_throw(void* ptr, size_t size, size_t n, FILE* f) {
+    FAISS_THROW_IF_NOT_MSG(fread(ptr, size, n, f) == n,
+                           "could not read the file, is it truncated?");
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,41 @@
+#include <rnn-descent/huge_pages.h>
+
+#include <cstdint>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace rnndescent {
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+bool advise_huge_pages(const void* ptr, size_t size) {
+    const uintptr_t huge_page = uintptr_t(1) << 21;
+    uintptr_t begin = ((uintptr_t)ptr + huge_page - 1) & ~(huge_page - 1);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~(huge_page - 1);
+    if (begin >= end) {
+        // smaller than a huge page, nothing to do
+        return true;
+    }
+    if (madvise((void*)begin, end - begin, MADV_HUGEPAGE) != 0) {
+        return false;
+    }
+    // without MADV_COLLAPSE, khugepaged collapses the pages in background
+    madvise((void*)begin, end - begin, MADV_COLLAPSE);
+    return true;
+}
+
+#else
+
+bool advise_huge_pages(const void* ptr, size_t size) {
+    return false;
+}
+
+#endif
+
+}  // namespace rnndescent
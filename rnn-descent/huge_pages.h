@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+
+namespace rnndescent {
+
+/** Ask the kernel to back the 2 MB aligned part of [ptr, ptr + size) with
+ * transparent huge pages, and to collapse the pages already allocated when
+ * the kernel supports it (Linux >= 6.1). Returns false if huge pages are
+ * not available, in which case the memory is left as it is.
+ */
+bool advise_huge_pages(const void* ptr, size_t size);
+
+}  // namespace rnndescent
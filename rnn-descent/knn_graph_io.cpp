@@ -0,0 +1,68 @@
+#include <rnn-descent/knn_graph_io.h>
+
+#include <faiss/impl/FaissAssert.h>
+#include <rnn-descent/file_io.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+namespace rnndescent {
+
+namespace {
+
+const char knn_graph_magic[4] = {'K', 'N', 'N', 'G'};
+
+}  // namespace
+
+void write_knn_graph(const char* fname, size_t n, int k,
+                     const faiss::idx_t* labels, const float* distances) {
+    FAISS_THROW_IF_NOT(k > 0);
+    FAISS_THROW_IF_NOT(n <= std::numeric_limits<int32_t>::max());
+    File f = open_file(fname, "wb");
+
+    int32_t header[2] = {(int32_t)n, k};
+    write_or_throw(knn_graph_magic, 1, 4, f.get());
+    write_or_throw(header, sizeof(int32_t), 2, f.get());
+
+    // the labels are narrowed by blocks
+    const size_t total = n * k;
+    const size_t bs = 1 << 16;
+    std::vector<int32_t> buf(std::min(bs, total));
+    for (size_t i0 = 0; i0 < total; i0 += bs) {
+        size_t i1 = std::min(i0 + bs, total);
+        for (size_t i = i0; i < i1; i++) {
+            FAISS_THROW_IF_NOT(labels[i] < (faiss::idx_t)n);
+            buf[i - i0] = labels[i] < 0 ? -1 : (int32_t)labels[i];
+        }
+        write_or_throw(buf.data(), sizeof(int32_t), i1 - i0, f.get());
+    }
+    write_or_throw(distances, sizeof(float), total, f.get());
+}
+
+void read_knn_graph(const char* fname, size_t& n, int& k,
+                    std::vector<faiss::idx_t>& labels,
+                    std::vector<float>& distances) {
+    File f = open_file(fname, "rb");
+
+    char magic[4];
+    int32_t header[2];
+    read_or_throw(magic, 1, 4, f.get());
+    FAISS_THROW_IF_NOT_FMT(memcmp(magic, knn_graph_magic, 4) == 0,
+                           "%s is not a KNN graph file", fname);
+    read_or_throw(header, sizeof(int32_t), 2, f.get());
+    FAISS_THROW_IF_NOT(header[0] >= 0 && header[1] > 0);
+    n = header[0];
+    k = header[1];
+
+    const size_t total = n * k;
+    std::vector<int32_t> buf(total);
+    read_or_throw(buf.data(), sizeof(int32_t), total, f.get());
+    labels.assign(buf.begin(), buf.end());
+    distances.resize(total);
+    read_or_throw(distances.data(), sizeof(float), total, f.get());
+}
+
+}  // namespace rnndescent
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <faiss/MetricType.h>
+
+#include <cstddef>
+#include <vector>
+
+namespace rnndescent {
+
+/** Write a KNN graph of n vectors (n x k labels and distances, e.g. from
+ * IndexRNNDescent::compute_knn_graph) to fname. The file holds the 4 bytes
+ * "KNNG", n and k as int32, the n * k labels as int32 (-1 for missing) and
+ * the n * k distances as float32, in native byte order.
+ */
+void write_knn_graph(const char* fname, size_t n, int k,
+                     const faiss::idx_t* labels, const float* distances);
+
+/// Read a file written by write_knn_graph
+void read_knn_graph(const char* fname, size_t& n, int& k,
+                    std::vector<faiss::idx_t>& labels,
+                    std::vector<float>& distances);
+
+}  // namespace rnndescent
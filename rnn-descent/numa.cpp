@@ -0,0 +1,125 @@
+#include <rnn-descent/numa.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace rnndescent {
+
+#ifdef __linux__
+
+namespace {
+
+// from <linux/mempolicy.h>
+constexpr int MPOL_INTERLEAVE_ = 3;
+constexpr unsigned MPOL_MF_MOVE_ = 1 << 1;
+
+/// Parse a list of ranges such as "0-15,32-47"
+std::vector<int> read_list(const char* path) {
+    std::vector<int> res;
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return res;
+    }
+    int a, b;
+    while (fscanf(f, "%d", &a) == 1) {
+        b = a;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &b) != 1) break;
+            c = fgetc(f);
+        }
+        for (int i = a; i <= b; i++) {
+            res.push_back(i);
+        }
+        if (c != ',') break;
+    }
+    fclose(f);
+    return res;
+}
+
+}  // namespace
+
+int numa_num_nodes() {
+    static const int n = [] {
+        auto nodes = read_list("/sys/devices/system/node/online");
+        return nodes.empty() ? 1 : nodes.back() + 1;
+    }();
+    return n;
+}
+
+int numa_current_node() {
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return 0;
+    }
+    return node;
+}
+
+bool numa_interleave_memory(const void* ptr, size_t size) {
+    int n = numa_num_nodes();
+    if (n <= 1 || size == 0) {
+        return false;
+    }
+    // mbind works on whole pages
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = (size_t)ptr & ~(page - 1);
+    size_t end = (size_t)ptr + size;
+
+    std::vector<unsigned long> mask((n + 63) / 64, 0);
+    for (int i = 0; i < n; i++) {
+        mask[i / 64] |= 1UL << (i % 64);
+    }
+    return syscall(SYS_mbind, begin, end - begin, MPOL_INTERLEAVE_,
+                   mask.data(), mask.size() * 64 + 1, MPOL_MF_MOVE_) == 0;
+}
+
+void numa_run_on_node(int node, const std::function<void()>& f) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    auto cpus = read_list(path);
+
+    cpu_set_t old_set, set;
+    bool bound = !cpus.empty() &&
+                 sched_getaffinity(0, sizeof(old_set), &old_set) == 0;
+    if (bound) {
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+        }
+        bound = sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+    f();
+    if (bound) {
+        sched_setaffinity(0, sizeof(old_set), &old_set);
+    }
+}
+
+#else
+
+int numa_num_nodes() {
+    return 1;
+}
+
+int numa_current_node() {
+    return 0;
+}
+
+bool numa_interleave_memory(const void* ptr, size_t size) {
+    return false;
+}
+
+void numa_run_on_node(int node, const std::function<void()>& f) {
+    f();
+}
+
+#endif
+
+}  // namespace rnndescent
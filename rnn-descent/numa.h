@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+namespace rnndescent {
+
+/* Minimal NUMA support on Linux through the system calls, so that libnuma
+   is not required. On other systems there is a single node and the
+   placement functions do nothing. */
+
+/// Number of NUMA nodes, 1 if unknown
+int numa_num_nodes();
+
+/// Node of the CPU the calling thread runs on, 0 if unknown
+int numa_current_node();
+
+/// Interleave the pages of [ptr, ptr + size) over all the nodes, the pages
+/// already allocated are moved. Returns false if not supported.
+bool numa_interleave_memory(const void* ptr, size_t size);
+
+/// Run f on the calling thread bound to the CPUs of node, so that the
+/// memory first touched by f is allocated on node
+void numa_run_on_node(int node, const std::function<void()>& f);
+
+}  // namespace rnndescent
@@ -0,0 +1,8 @@
+/* Kernels for CPUs with AVX2, FMA and F16C. Only the kernels get these
+   instruction sets, see simd_target.h. */
+
+#define RNNDESCENT_SIMD_NS avx2
+#define RNNDESCENT_TARGET_AVX2
+
+#include <rnn-descent/RNNDescent-inl.h>
+#include <rnn-descent/distances-inl.h>
@@ -0,0 +1,8 @@
+/* Kernels for CPUs with AVX-512F. Only the kernels get this instruction
+   set, together with those of simd_avx2.cpp, see simd_target.h. */
+
+#define RNNDESCENT_SIMD_NS avx512
+#define RNNDESCENT_TARGET_AVX512
+
+#include <rnn-descent/RNNDescent-inl.h>
+#include <rnn-descent/distances-inl.h>
@@ -0,0 +1,83 @@
+#pragma once
+
+/* Entry points of the kernels compiled once per SIMD level (simd_*.cpp),
+   and the dispatch to the one selected by simd_level(). */
+
+#include <faiss/impl/AuxIndexStructures.h>
+#include <faiss/impl/DistanceComputer.h>
+#include <rnn-descent/RNNDescent.h>
+#include <rnn-descent/distances.h>
+#include <rnn-descent/simd_level.h>
+
+#include <random>
+
+namespace rnndescent {
+
+void gen_random(std::mt19937& rng, int* addr, const int size, const int N);
+
+#define RNNDESCENT_DECLARE_SIMD_FUNCTIONS(ns)                                 \
+    namespace ns {                                                            \
+    void update_neighbors(RNNDescent& rnndescent,                             \
+                          faiss::DistanceComputer& qdis, float alpha);        \
+    void search_in_range(const RNNDescent& rnndescent,                        \
+                         faiss::DistanceComputer& qdis, const int begin,      \
+                         const int end, const int topk, int L,                \
+                         faiss::idx_t* indices, float* dists,                 \
+                         faiss::VisitedTable& vt,                             \
+                         const SearchParametersRNNDescent* params,            \
+                         int entry, const float radius,                       \
+                         std::vector<faiss::nndescent::Neighbor>* in_radius); \
+    void search_parallel(const RNNDescent& rnndescent,                        \
+                         faiss::DistanceComputer** team_dis,                  \
+                         const int n_threads, const int topk, int L,          \
+                         faiss::idx_t* indices, float* dists,                 \
+                         faiss::VisitedTable& vt,                             \
+                         const SearchParametersRNNDescent* params,            \
+                         int entry);                                          \
+    void search_batch(const RNNDescent& rnndescent, FlatDistanceComputer& dis, \
+                      const int nq, const float* xq, const int topk, int L,   \
+                      faiss::idx_t* indices, float* dists,                    \
+                      faiss::VisitedTable& vt,                                \
+                      const SearchParametersRNNDescent* params);              \
+    float fvec_L2sqr_bounded(const float* x, const float* y, size_t d,        \
+                             float bound);                                    \
+    const FlatKernels& get_flat_kernels(FlatCodec codec,                      \
+                                        faiss::MetricType metric);            \
+    }
+
+RNNDESCENT_DECLARE_SIMD_FUNCTIONS(generic)
+#ifdef RNNDESCENT_HAVE_AVX2
+RNNDESCENT_DECLARE_SIMD_FUNCTIONS(avx2)
+#endif
+#ifdef RNNDESCENT_HAVE_AVX512
+RNNDESCENT_DECLARE_SIMD_FUNCTIONS(avx512)
+#endif
+
+#undef RNNDESCENT_DECLARE_SIMD_FUNCTIONS
+
+#ifdef RNNDESCENT_HAVE_AVX512
+#define RNNDESCENT_DISPATCH_AVX512(call) \
+    case SIMDLevel::AVX512:              \
+        return avx512::call;
+#else
+#define RNNDESCENT_DISPATCH_AVX512(call)
+#endif
+
+#ifdef RNNDESCENT_HAVE_AVX2
+#define RNNDESCENT_DISPATCH_AVX2(call) \
+    case SIMDLevel::AVX2:              \
+        return avx2::call;
+#else
+#define RNNDESCENT_DISPATCH_AVX2(call)
+#endif
+
+/// return call, with the implementation of the current SIMD level
+#define RNNDESCENT_SIMD_DISPATCH(call)     \
+    switch (simd_level()) {                \
+        RNNDESCENT_DISPATCH_AVX512(call)   \
+        RNNDESCENT_DISPATCH_AVX2(call)     \
+        default:                           \
+            return generic::call;          \
+    }
+
+}  // namespace rnndescent
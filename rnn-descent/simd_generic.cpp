@@ -0,0 +1,7 @@
+/* Kernels without explicit SIMD, for any CPU. The compiler may still
+   auto-vectorize them for the baseline instruction set. */
+
+#define RNNDESCENT_SIMD_NS generic
+
+#include <rnn-descent/RNNDescent-inl.h>
+#include <rnn-descent/distances-inl.h>
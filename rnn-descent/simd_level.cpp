@@ -0,0 +1,76 @@
+#include <faiss/impl/FaissAssert.h>
+#include <rnn-descent/simd_level.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+namespace rnndescent {
+
+namespace {
+
+SIMDLevel parse_simd_level(const char* name) {
+    if (!strcmp(name, "avx512")) return SIMDLevel::AVX512;
+    if (!strcmp(name, "avx2")) return SIMDLevel::AVX2;
+    if (!strcmp(name, "none")) return SIMDLevel::NONE;
+    FAISS_THROW_FMT("unknown SIMD level %s", name);
+}
+
+SIMDLevel initial_simd_level() {
+    SIMDLevel level = detect_simd_level();
+    if (const char* env = getenv("RNNDESCENT_SIMD_LEVEL")) {
+        SIMDLevel requested = parse_simd_level(env);
+        if (requested < level) {
+            level = requested;
+        }
+    }
+    return level;
+}
+
+std::atomic<SIMDLevel>& current_simd_level() {
+    static std::atomic<SIMDLevel> level(initial_simd_level());
+    return level;
+}
+
+}  // namespace
+
+SIMDLevel detect_simd_level() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#ifdef RNNDESCENT_HAVE_AVX512
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("f16c")) {
+        return SIMDLevel::AVX512;
+    }
+#endif
+#ifdef RNNDESCENT_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("f16c")) {
+        return SIMDLevel::AVX2;
+    }
+#endif
+#endif
+    return SIMDLevel::NONE;
+}
+
+SIMDLevel simd_level() { return current_simd_level().load(); }
+
+void set_simd_level(SIMDLevel level) {
+    FAISS_THROW_IF_NOT_FMT(level <= detect_simd_level(),
+                           "SIMD level %s is not supported on this machine",
+                           simd_level_name(level));
+    current_simd_level().store(level);
+}
+
+const char* simd_level_name(SIMDLevel level) {
+    switch (level) {
+        case SIMDLevel::AVX512:
+            return "avx512";
+        case SIMDLevel::AVX2:
+            return "avx2";
+        default:
+            return "none";
+    }
+}
+
+}  // namespace rnndescent
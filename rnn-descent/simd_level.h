@@ -0,0 +1,22 @@
+#pragma once
+
+namespace rnndescent {
+
+/// Instruction sets the kernels of RNNDescent are compiled for
+enum class SIMDLevel { NONE, AVX2, AVX512 };
+
+/** SIMD level used by the kernels. It is the best level supported by both
+ * the CPU and the build, unless lowered by the RNNDESCENT_SIMD_LEVEL
+ * environment variable ("none", "avx2" or "avx512") or set_simd_level.
+ */
+SIMDLevel simd_level();
+
+/// Force the SIMD level, it must be supported by the CPU and the build
+void set_simd_level(SIMDLevel level);
+
+/// Best SIMD level supported by both the CPU and the build
+SIMDLevel detect_simd_level();
+
+const char* simd_level_name(SIMDLevel level);
+
+}  // namespace rnndescent
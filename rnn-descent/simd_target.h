@@ -0,0 +1,46 @@
+#pragma once
+
+/* Instruction set of the kernels of a simd_*.cpp file, which defines
+   RNNDESCENT_TARGET_AVX2 or RNNDESCENT_TARGET_AVX512 before including the
+   -inl headers. These enclose their kernels, and none of the headers they
+   include, between RNNDESCENT_TARGET_BEGIN and RNNDESCENT_TARGET_END.
+
+   The files are not compiled with -mavx2 or -mavx512f: the inline functions
+   and the templates of the other headers (std::sort, std::vector,
+   faiss::VisitedTable...) are then emitted for the baseline instruction set
+   in every file, so that the copy the linker keeps runs on any CPU. Only
+   the functions of the RNNDESCENT_SIMD_NS namespace get the instruction
+   set, and they are called after simd_level() checked it. */
+
+#if defined(RNNDESCENT_TARGET_AVX512)
+#define RNNDESCENT_TARGET_ISA "avx512f,avx2,fma,f16c"
+#elif defined(RNNDESCENT_TARGET_AVX2)
+#define RNNDESCENT_TARGET_ISA "avx2,fma,f16c"
+#endif
+
+#ifdef RNNDESCENT_TARGET_ISA
+
+#include <immintrin.h>
+
+#define RNNDESCENT_PRAGMA(x) RNNDESCENT_PRAGMA_(x)
+#define RNNDESCENT_PRAGMA_(x) _Pragma(#x)
+
+#if defined(__clang__)
+#define RNNDESCENT_TARGET_BEGIN                         \
+    RNNDESCENT_PRAGMA(clang attribute push(             \
+        __attribute__((target(RNNDESCENT_TARGET_ISA))), \
+        apply_to = function))
+#define RNNDESCENT_TARGET_END RNNDESCENT_PRAGMA(clang attribute pop)
+#else
+#define RNNDESCENT_TARGET_BEGIN         \
+    RNNDESCENT_PRAGMA(GCC push_options) \
+    RNNDESCENT_PRAGMA(GCC target(RNNDESCENT_TARGET_ISA))
+#define RNNDESCENT_TARGET_END RNNDESCENT_PRAGMA(GCC pop_options)
+#endif
+
+#else
+
+#define RNNDESCENT_TARGET_BEGIN
+#define RNNDESCENT_TARGET_END
+
+#endif